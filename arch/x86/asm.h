@@ -3,9 +3,16 @@
 #include <sys/myos.h>
 
 struct Asm {
+	// value must not be 0 for both bsf and bsr
 	static inline u32 bsf(u32 value) {
 		u32 offset;
-		asm("bsf %0, %1" : "=r"(offset) : "r"(value));
+		asm("bsf %1, %0" : "=r"(offset) : "rm"(value));
+		return offset;
+	}
+
+	static inline u32 bsr(u32 value) {
+		u32 offset;
+		asm("bsr %1, %0" : "=r"(offset) : "rm"(value));
 		return offset;
 	}
 
@@ -19,7 +19,7 @@ struct Serial {
 
 	static Com CurrentPort;
 
-	static void init();
+	static void init(Com port = CurrentPort);
 
 	static void setPort(Com port) {
 		CurrentPort = port;
@@ -35,13 +35,13 @@ struct Serial {
 		return IO::inb(CurrentPort);
 	}
 
-	static u8 isTransmitEmpty() {
-		return IO::inb(CurrentPort + 5) & 0x20;
+	static u8 isTransmitEmpty(Com port = CurrentPort) {
+		return IO::inb(port + 5) & 0x20;
 	}
 
-	static void write(char c) {
-		while(isTransmitEmpty() == 0)
+	static void write(char c, Com port = CurrentPort) {
+		while(isTransmitEmpty(port) == 0)
 			;
-		IO::outb(CurrentPort, c);
+		IO::outb(port, c);
 	}
 };
@@ -1,38 +1,83 @@
+#include <arch/x86/asm.h>
 #include <drivers/terminal.h>
 #include <mem/heap.h>
+#include <mem/heapprofiler.h>
+#include <mem/heaptrace.h>
 #include <mem/paging.h>
 #include <sched/scopedlock.h>
 #include <sys/string.h>
 
 void Heap::init(siz base, siz size, Paging::Directory *dir) {
+	reserve(base, size, dir);
+	setup();
+}
+
+void Heap::reserve(siz base, siz size, Paging::Directory *dir) {
 	directory = dir;
 	// size must be pagealigned
 	Paging::alignIfNeeded(size);
-	heapStart = (uptr)base;
-	heapEnd   = heapStart + size;
+	heapStart          = (uptr)base;
+	heapEnd            = heapStart + size;
+	ready              = false;
+	remoteFrees        = NULL;
+	emptyBuckets       = 0;
+	emptyPerClass      = DefaultEmptyPerClass;
+	emptyLowWatermark  = DefaultEmptyLowWatermark;
+	emptyHighWatermark = DefaultEmptyHighWatermark;
+	heapLock           = SpinLock();
+	// the heap takes the pages it has not mapped yet to be zero, so
+	// nothing may be mapped in the range. Directory::clone leaves the
+	// heap of the parent of a task out for this.
+}
+
+void Heap::setup() {
+	siz size = heapEnd - heapStart;
 	// after us, the first we'll do is make space for
 	// all the buckets that we may create in the future.
 	buckets = (Bucket *)(heapStart);
 
-	// we'll use the first page for ourselves, and leave
-	// the rest of the place for everything else.
-	uptr usable         = size;
-	bucketAdditionalMem = 1;
-	// try to find an optimal range where we will have
-	// enough place to place the buckets themselves
-	while(bucketAdditionalMem + usable > size) {
-		// reduce the usable memory by a page
-		usable -= Paging::PageSize;
-		maxBucketMemory     = usable / BucketRatio;
-		numBuckets          = maxBucketMemory / BucketSize;
-		bucketAdditionalMem = numBuckets * sizeof(Bucket);
-	}
+	// every page of usable memory costs at most a share of a bucket,
+	// a span and a huge tag structure. so the structures of the heap
+	// take no more than those of 'size' bytes of usable memory, which
+	// are kept in pages at the start, leaving the rest as usable.
+	siz pages = size / Paging::PageSize;
+	siz meta  = (pages * MetaPerScale + ScalePages - 1) / ScalePages;
+	Paging::alignIfNeeded(meta);
+	siz usable = size - meta;
+	// now find the exact number of each, which can only be lower
+	maxBucketMemory     = usable / BucketRatio;
+	numBuckets          = maxBucketMemory / BucketSize;
+	bucketAdditionalMem = numBuckets * sizeof(Bucket);
+	// spans get their share of whatever is left after the buckets
+	numSpans = (usable - numBuckets * BucketSize) / MediumRatio / SpanSize;
+	spanAdditionalMem = numSpans * sizeof(Span);
+	// and the huge allocations get theirs out of the rest,
+	// leaving the remaining to the headers
+	numHugePages =
+	    (usable - numBuckets * BucketSize - numSpans * SpanSize) / HugeRatio /
+	    Paging::PageSize;
+	hugeAdditionalMem = numHugePages * sizeof(u32);
+	// the last bucket must not spill over to the spans
+	maxBucketMemory = numBuckets * BucketSize;
+	// the spans are kept right after the buckets
+	spans = (Span *)((uptr)buckets + bucketAdditionalMem);
+	// followed by the huge tags
+	hugeRuns = (u32 *)((uptr)spans + spanAdditionalMem);
 	// PROMPT_INIT("Heap::init", Orange);
-	// make sure all the pages needed by us to manage the heap
-	// are allocated
-	for(uptr i = (uptr)heapStart; i < (uptr)buckets + bucketAdditionalMem;
-	    i += Paging::PageSize) {
-		Paging::getPage(i, true, directory)->alloc(true, true);
+	// the pages we map are zeroed, so switch to the directory
+	// which will own them
+	auto bak = Paging::Directory::CurrentDirectory;
+	Paging::switchPageDirectory(directory);
+	// the structures are sized for a full heap, so they are only
+	// mapped as they are used, unless the directory is out of
+	// regions, in which case they are all mapped right away
+	uptr metaStart = heapStart & ~(Paging::PageSize - 1);
+	uptr metaEnd   = (uptr)hugeRuns + hugeAdditionalMem;
+	Paging::alignIfNeeded(metaEnd);
+	if(!Paging::addRegion(metaStart, metaEnd, Paging::Region::DemandZero,
+	                      directory)) {
+		for(uptr i = metaStart; i < metaEnd; i += Paging::PageSize)
+			Paging::getPage(i, true, directory)->alloc(true, true);
 	}
 	// we'll use 'usable' amount of memory from the end of this heap,
 	// so calculate that first.
@@ -40,232 +85,337 @@ void Heap::init(siz base, siz size, Paging::Directory *dir) {
 	// page align the starting address
 	Paging::alignIfNeeded(start);
 	bucketAllocationCurrent = bucketAllocationStart = start;
-	bucketAllocationEnd  = bucketAllocationStart + maxBucketMemory - 1;
-	largeAllocationStart = bucketAllocationEnd + 1;
-	largeAllocationEnd   = heapEnd;
+	bucketAllocationEnd     = bucketAllocationStart + maxBucketMemory - 1;
+	mediumAllocationStart   = bucketAllocationEnd + 1;
+	mediumAllocationCurrent = mediumAllocationStart;
+	mediumAllocationEnd     = mediumAllocationStart + numSpans * SpanSize;
+	largeAllocationStart    = mediumAllocationEnd;
+	hugeAllocationEnd       = heapEnd & ~(Paging::PageSize - 1);
+	hugeAllocationStart =
+	    hugeAllocationEnd - numHugePages * Paging::PageSize;
+	largeAllocationEnd = hugeAllocationStart;
 
-	for(siz i = 0; i < BlockCount; i++) bucketClassList[i] = NULL;
+	for(siz i = 0; i < BlockCount; i++) {
+		sizeClasses[i].partial     = NULL;
+		sizeClasses[i].full        = NULL;
+		sizeClasses[i].empty       = NULL;
+		sizeClasses[i].emptyCount  = 0;
+		sizeClasses[i].bucketCount = 0;
+		smallCounters[i]           = Counter();
+	}
+
+	for(siz i = 0; i < MediumClassCount; i++) {
+		mediumClasses[i].partial    = NULL;
+		mediumClasses[i].full       = NULL;
+		mediumClasses[i].empty      = NULL;
+		mediumClasses[i].emptyCount = 0;
+		mediumClasses[i].spanCount  = 0;
+		mediumCounters[i]           = Counter();
+	}
+	largeCounter   = Counter();
+	hugeCounter    = Counter();
+	for(siz i = 0; i < (siz)MemTag::Count; i++) tagCounters[i] = TagCounter();
+	bytesInUse     = peakBytesInUse   = 0;
+	bucketsInUse   = peakBucketsInUse = 0;
+	spansInUse     = peakSpansInUse   = 0;
+	freeSpans = NULL;
+
+	// the whole huge region is a single free run
+	if(numHugePages)
+		setHugeRun(0, numHugePages, false);
 
 	freeBuckets = NULL;
 
+	firstLevelMap = 0;
+	for(siz i = 0; i < FirstLevelCount; i++) {
+		secondLevelMap[i] = 0;
+		for(siz j = 0; j < SecondLevelCount; j++) freeHeaders[i][j] = NULL;
+	}
+
 	// initialize the large header
-	headerRoot = (Header *)largeAllocationStart;
-	headerRoot->ensureMapped(directory);
-	auto bak = Paging::Directory::CurrentDirectory;
-	Paging::switchPageDirectory(directory);
-	headerRoot->allocationSize = (largeAllocationEnd - largeAllocationStart);
-	headerRoot->left           = NULL;
-	headerRoot->right          = NULL;
-	headerRoot->previousHeader = NULL;
-	headerRoot->magic          = Header::Magic;
-	heapLock                   = SpinLock();
+	Header *first = (Header *)largeAllocationStart;
+	first->ensureMapped(directory);
+	largeTouched          = largeAllocationStart + sizeof(Header);
+	first->allocationSize = (largeAllocationEnd - largeAllocationStart);
+	first->previousHeader = NULL;
+	first->magic          = Header::Magic;
+	insertHeader(first);
 	Paging::switchPageDirectory(bak);
+	ready = true;
 	// PROMPT("Heap init complete!");
 }
 
-void *Heap::alloc(siz bytes) {
-	ScopedLock sl(heapLock); // make sure only one thread accesses it
-	if(bytes <= BlockEnd) {
-		// we can do bucket allocation
-		bytes = blockNearest(bytes);
-		siz c = getSizeClass(bytes);
-		if(bucketClassList[c]) {
-			Bucket *b = bucketClassList[c];
-			void   *m = b->allocateBlock();
-			if(m)
-				return m;
-			// try to find a bucket which can allocate this block
-			for(Bucket *buk = b->nextBucket; buk != NULL;
-			    b = buk, buk = buk->nextBucket) {
-				void *m = buk->allocateBlock();
-				if(m) {
-					// this bucket did find something to allocate
-					// put this bucket to the front of the class list
-					b->nextBucket      = buk->nextBucket;
-					buk->nextBucket    = bucketClassList[c];
-					bucketClassList[c] = buk;
-					return m;
-				}
-			}
-		}
-		// try to allocate a new bucket
-		Bucket *b = allocBucket(bytes, c);
-		if(!b)
-			return NULL;
-		return b->allocateBlock();
-	} else {
-		// round up to the next multiple of 8 to make sure
-		// our allocation stays aligned
-		bytes = roundUp8(bytes);
-		// use huge allocators
-		Header *h = findClosestHeader(bytes);
-		if(!h) {
-			Terminal::err("No free header found to allocate!\n");
-			for(;;)
-				;
-		}
-		h->magic = Header::Magic | 1;
-		// remove it from the tree
-		removeHeader(h);
-		// check if we can break it
-		// we'll only break a header if it contains enough space to allocate
-		// a new huge object, i.e. of size BlockEnd + 1
-		if(h->allocationSize > bytes + sizeof(Header) + BlockEnd) {
-			Header *nh = (Header *)((uptr)h + sizeof(Header) + bytes);
-			nh->ensureMapped(directory);
-			nh->magic          = Header::Magic;
-			nh->left           = NULL;
-			nh->right          = NULL;
-			nh->previousHeader = h;
-			nh->allocationSize = h->allocationSize - bytes - sizeof(Header);
-			// insert the new header
-			insertHeader(nh);
-			// adjust the old header
-			h->allocationSize = bytes + sizeof(Header);
+void *Heap::allocSmall(siz bytes, bool *zeroed) {
+	// we can do bucket allocation
+	bytes         = blockNearest(bytes);
+	SizeClass &sc = sizeClasses[getSizeClass(bytes)];
+	Bucket    *b  = sc.partial;
+	if(!b) {
+		if(sc.empty) {
+			// reuse the bucket which is still mapped
+			b = popEmptyBucket(sc);
+		} else {
+			// try to allocate a new bucket
+			b = allocBucket(bytes);
+			if(!b)
+				return NULL;
 		}
-		h->ensureMapped(directory, true);
-		return (void *)((uptr)h + sizeof(Header));
+		pushBucket(&sc.partial, b);
 	}
+	return allocFromBucket(sc, b, zeroed);
+}
+
+void *Heap::allocFromBucket(SizeClass &sc, Bucket *b, bool *zeroed) {
+	// only the blocks which are not carved out yet from a
+	// zeroed bucket are known to be zero
+	if(zeroed)
+		*zeroed = b->zeroed && b->nextBlock == NULL;
+	void *m = b->allocateBlock();
+	countAlloc(smallCounters[&sc - sizeClasses], b->blockSize);
+	if(b->numAvailBlocks == 0) {
+		// the bucket is full now
+		unlinkBucket(&sc.partial, b);
+		pushBucket(&sc.full, b);
+	}
+	return m;
+}
+
+void *Heap::alloc(siz bytes) {
+	if(HeapProfiler::Enabled)
+		HeapProfiler::sample(bytes);
+	ScopedLock sl(heapLock); // make sure only one thread accesses it
+	prepareAlloc();
+	void *m = allocUnlocked(bytes);
+	HeapTrace::record(HeapTrace::Alloc, this, m, bytes);
+	return m;
+}
+
+void *Heap::allocUnlocked(siz bytes) {
+	if(bytes <= BlockEnd)
+		return allocSmall(bytes);
+	// when a tier runs out of space, the allocation falls back
+	// to the next one up
+	void *m = NULL;
+	if(bytes <= MediumEnd)
+		m = allocMedium(bytes);
+	if(!m)
+		m = allocHuge(bytes);
+	return m ? m : allocLarge(bytes);
 }
 
 void *Heap::alloc_a(siz bytes) {
+	return alloc_aligned(bytes, Paging::PageSize);
+}
+
+void *Heap::alloc_aligned(siz bytes, siz align) {
+	if(HeapProfiler::Enabled)
+		HeapProfiler::sample(bytes);
 	ScopedLock sl(heapLock); // make sure only one thread accesses it
-	if(bytes <= BlockEnd) {
-		bytes   = blockNearest(bytes);
-		siz cls = getSizeClass(bytes);
-		// to alloc a page aligned byte within a bucket,
-		// it must be the first allocation of a bucket,
-		// buckets themselves are page aligned. so, find
-		// a free bucket.
-		Bucket *b = allocBucket(bytes, cls);
-		if(!b) {
-			Terminal::err("No free bucket found to allocate aligned!\n");
-			for(;;)
-				;
+	prepareAlloc();
+	void *m = allocAligned(bytes, align, false);
+	HeapTrace::record(HeapTrace::AllocAligned, this, m, bytes, align);
+	return m;
+}
+
+void *Heap::allocAligned(siz bytes, siz align, bool zero) {
+	if(align < BlockWidth)
+		align = BlockWidth;
+	if(align & (align - 1)) {
+		Terminal::err("Alignment must be a power of 2!\n");
+		for(;;)
+			;
+	}
+	void *m      = NULL;
+	bool  zeroed = false;
+	if(align < Paging::PageSize) {
+		// buckets and spans are page aligned, so all the blocks of
+		// a class are aligned to the largest power of 2 dividing
+		// its size. the smallest class which is a multiple of the
+		// alignment does the job.
+		siz padded = (bytes + align - 1) & -align;
+		if(padded <= BlockEnd) {
+			m = allocSmall(padded, &zeroed);
+			if(m && zero && !zeroed)
+				memset(m, 0, padded);
+			return m;
 		}
-		return b->allocateBlock();
+		if(padded <= MediumEnd)
+			m = allocMedium(padded, align, &zeroed);
+	} else if(align == Paging::PageSize && bytes > BlockEnd &&
+	          bytes <= MediumEnd) {
+		// some of the medium classes are multiples of the page size
+		m = allocMedium(bytes, align, &zeroed);
+	}
+	if(m) {
+		if(zero && !zeroed)
+			memset(m, 0, bytes);
+		return m;
+	}
+	// everything else, including the small page aligned allocations,
+	// takes whole pages of the huge region
+	m = allocHuge(bytes, align < Paging::PageSize ? Paging::PageSize : align);
+	if(m || align > Paging::PageSize)
+		return m;
+	uptr touched = largeTouched;
+	m            = allocLargeAligned(bytes);
+	if(zero)
+		zeroLarge(m, bytes, touched);
+	return m;
+}
+
+void *Heap::allocLarge(siz bytes) {
+	// round up to the next multiple of 8 to make sure
+	// our allocation stays aligned
+	bytes = roundUp8(bytes);
+	// use huge allocators
+	Header *h = findClosestHeader(bytes);
+	if(!h) {
+		Terminal::err("No free header found to allocate!\n");
+		for(;;)
+			;
+	}
+	h->magic = Header::Magic | 1;
+	// remove it from the free lists
+	removeHeader(h);
+	// check if we can break it
+	splitHeader(h, bytes);
+	h->ensureMapped(directory, true);
+	touchLarge((uptr)h + h->allocationSize);
+	countAlloc(largeCounter, h->allocationSize);
+	h->tag = MemTag::None;
+	return (void *)((uptr)h + sizeof(Header));
+}
+
+void *Heap::allocLargeAligned(siz bytes) {
+	bytes = roundUp8(bytes);
+	// try to find a free header
+	Header *header = findClosestHeader(bytes, true);
+	if(!header) {
+		Terminal::err("No free header found to allocate aligned!\n");
+		for(;;)
+			;
+	}
+	// remove ourselves from the free lists first
+	removeHeader(header);
+	// mark it used
+	header->magic |= 1;
+	uptr addrStart = (uptr)header + sizeof(Header);
+	// make the address aligned
+	Paging::alignIfNeeded(addrStart);
+	if(addrStart - sizeof(Header) == (uptr)header) {
+		// we are luckily in the perfect position to make
+		// the returned memory page aligned, so we don't
+		// need to do anything except for following
+		// the routine procedure.
 	} else {
-		bytes = roundUp8(bytes);
-		// try to find a free header
-		Header *header = findClosestHeader(bytes, true);
-		if(!header) {
-			Terminal::err("No free header found to allocate aligned!\n");
-			for(;;)
-				;
-		}
-		// remove ourselves from the tree first
-		removeHeader(header);
-		// mark it used
-		header->magic |= 1;
-		uptr addrStart = (uptr)header + sizeof(Header);
-		// make the address aligned
-		Paging::alignIfNeeded(addrStart);
-		if(addrStart - sizeof(Header) == (uptr)header) {
-			// we are luckily in the perfect position to make
-			// the returned memory page aligned, so we don't
-			// need to do anything except for following
-			// the routine procedure.
-		} else {
-			// we'll start from addrStart - sizeof(Header).
-			uptr newStart = addrStart - sizeof(Header);
-			// populate the new header
-			Header *newHeader = (Header *)newStart;
-			newHeader->ensureMapped(directory);
-			newHeader->magic = Header::Magic | 1;
-			newHeader->left = newHeader->right = NULL;
-			// this is the additional amount of memory that
-			// we will release
-			uptr additionalSize = newStart - (uptr)header;
-			// so, this will be our new size
-			newHeader->allocationSize = header->allocationSize - additionalSize;
-			// try to adjust our previous header
-			Header *prev              = header->previousHeader;
-			newHeader->previousHeader = prev;
-			// if we don't even have a previous header, we need
-			// to create a new one, providing we have enough
-			// space to create a new header. otherwise, we'll
-			// just keep the beginning of the allocation block
-			// empty, free will adjust us back.
-			if(!prev) {
-				if(additionalSize > sizeof(Header) + BlockEnd) {
-					Header *add = header; // this is our new fragmented header
-					add->allocationSize = additionalSize;
-					add->previousHeader = NULL;
-					add->left = add->right    = NULL;
-					add->magic                = Header::Magic;
-					newHeader->previousHeader = add;
-					insertHeader(add);
-				} else {
-					// we don't have enough size in front of us
-					// to perform a huge allocation. so keep the space empty
-				}
+		// we'll start from addrStart - sizeof(Header).
+		uptr newStart = addrStart - sizeof(Header);
+		// the new header may overlap with the old one, so
+		// read whatever we need from the old one first
+		siz     oldSize = header->allocationSize;
+		Header *prev    = header->previousHeader;
+		// populate the new header
+		Header *newHeader = (Header *)newStart;
+		newHeader->ensureMapped(directory);
+		newHeader->magic = Header::Magic | 1;
+		// this is the additional amount of memory that
+		// we will release
+		uptr additionalSize = newStart - (uptr)header;
+		// so, this will be our new size
+		newHeader->allocationSize = oldSize - additionalSize;
+		// try to adjust our previous header
+		newHeader->previousHeader = prev;
+		// if we don't even have a previous header, we need
+		// to create a new one, providing we have enough
+		// space to create a new header. otherwise, we'll
+		// just keep the beginning of the allocation block
+		// empty, free will adjust us back.
+		if(!prev) {
+			if(additionalSize > sizeof(Header) + BlockEnd) {
+				Header *add = header; // this is our new fragmented header
+				add->allocationSize       = additionalSize;
+				add->previousHeader       = NULL;
+				add->magic                = Header::Magic;
+				newHeader->previousHeader = add;
+				insertHeader(add);
 			} else {
-				// we have a previous header, remove that from the tree
-				// if it was free
-				if(prev->magic == Header::Magic)
-					removeHeader(prev);
-				// adjust its size
-				prev->allocationSize += additionalSize;
-				// insert that back
-				if(prev->magic == Header::Magic)
-					insertHeader(prev);
+				// we don't have enough size in front of us
+				// to perform a huge allocation. so keep the space empty
 			}
-			header = newHeader;
-		}
-		// finally, check if we have anough space to break us up
-		// we'll only break a header if it contains enough space to allocate
-		// a new huge object, i.e. of size BlockEnd + 1
-		if(header->allocationSize > bytes + sizeof(Header) + BlockEnd) {
-			Header *nh = (Header *)((uptr)header + sizeof(Header) + bytes);
-			nh->ensureMapped(directory);
-			nh->magic          = Header::Magic;
-			nh->left           = NULL;
-			nh->right          = NULL;
-			nh->previousHeader = header;
-			nh->allocationSize =
-			    header->allocationSize - bytes - sizeof(Header);
-			// insert the new header
-			insertHeader(nh);
-			// adjust the old header
-			header->allocationSize = bytes + sizeof(Header);
+		} else {
+			// we have a previous header, remove that from the free
+			// lists if it was free
+			if(prev->magic == Header::Magic)
+				removeHeader(prev);
+			// adjust its size
+			prev->allocationSize += additionalSize;
+			// when it is in use, the space is counted as its part
+			if(prev->magic != Header::Magic) {
+				bytesInUse += additionalSize;
+				if(prev->tag != MemTag::None)
+					countTagGrow(prev->tag, additionalSize);
+			}
+			// insert that back
+			if(prev->magic == Header::Magic)
+				insertHeader(prev);
 		}
-		header->ensureMapped(directory, true);
-		return (void *)((uptr)header + sizeof(Header));
+		// the header after us must now point to the moved header
+		Header *next = nextHeader(newHeader);
+		if(next)
+			next->previousHeader = newHeader;
+		header = newHeader;
+	}
+	// finally, check if we have anough space to break us up
+	splitHeader(header, bytes);
+	header->ensureMapped(directory, true);
+	touchLarge((uptr)header + header->allocationSize);
+	countAlloc(largeCounter, header->allocationSize);
+	header->tag = MemTag::None;
+	return (void *)((uptr)header + sizeof(Header));
+}
+
+void Heap::freeSmall(void *mem) {
+	// this is allocated by a bucket, so find it
+	siz        idx     = getBucketIndex((uptr)mem);
+	Bucket    *b       = &buckets[idx];
+	siz        cls     = getSizeClass(b->blockSize);
+	SizeClass &sc      = sizeClasses[cls];
+	bool       wasFull = b->numAvailBlocks == 0;
+	b->releaseBlock(mem);
+	countFree(smallCounters[cls], b->blockSize);
+	if(wasFull) {
+		// it has a free block now
+		unlinkBucket(&sc.full, b);
+		pushBucket(&sc.partial, b);
+	}
+	if(b->isEmpty()) {
+		unlinkBucket(&sc.partial, b);
+		// keep it mapped, and only give the pages back when
+		// too many of them have piled up
+		pushBucket(&sc.empty, b);
+		sc.emptyCount++;
+		emptyBuckets++;
+		if(emptyBuckets > emptyHighWatermark)
+			releaseEmptyBuckets(emptyLowWatermark, emptyPerClass);
 	}
 }
 
 void Heap::free(void *mem) {
 	ScopedLock sl(heapLock); // make sure only one thread accesses it
+	HeapTrace::record(HeapTrace::Free, this, mem);
+	freeUnlocked(mem);
+}
+
+void Heap::freeUnlocked(void *mem) {
 	if(!mem)
 		return;
 	uptr addr = (uptr)mem;
 	if(addr < bucketAllocationEnd) {
-		// this is allocated by a bucket, so find it
-		siz     idx = getBucketIndex(addr);
-		Bucket *b   = &buckets[idx];
-		b->releaseBlock(mem);
-		siz cls = getSizeClass(b->blockSize);
-		if(b->numAvailBlocks == BucketSize / b->blockSize) {
-			// add this bucket to the free list
-			Bucket *parent = NULL;
-			Bucket *c      = NULL;
-			for(c = bucketClassList[cls]; c != b; parent = c, c = c->nextBucket)
-				;
-			if(parent)
-				parent->nextBucket = b->nextBucket;
-			else
-				bucketClassList[cls] = b->nextBucket;
-			b->nextBucket = freeBuckets;
-			freeBuckets   = b;
-			// release the page back to the os
-			// we can only do this because we know
-			// startMem is page aligned and has size
-			// equal to the page size
-			Paging::getPage((uptr)b->startMem, false, directory)->free();
-		}
-		// otherwise, we may also want to add this bucket to the front
-		// of its size class, but that may generate unnecessary additional
-		// overhead. we'll see.
+		freeSmall(mem);
+	} else if(addr < mediumAllocationEnd) {
+		freeMedium(mem);
+	} else if(addr >= hugeAllocationStart) {
+		freeHuge(mem);
 	} else {
 		// find the header
 		Header *h = (Header *)((uptr)mem - sizeof(Header));
@@ -276,12 +426,15 @@ void Heap::free(void *mem) {
 		}
 		// mark us as free
 		h->magic = Header::Magic;
+		countFree(largeCounter, h->allocationSize);
+		if(h->tag != MemTag::None)
+			countTagFree(h->tag, h->allocationSize);
 		// check if next header is free, iff we're not the last header
-		Header *nh = (Header *)((uptr)h + h->allocationSize);
-		if((uptr)nh != largeAllocationEnd && nh->magic == Header::Magic) {
+		Header *nh = nextHeader(h);
+		if(nh && nh->magic == Header::Magic) {
 			// merge with next header, and remove next
-			Header *nnh = (Header *)((uptr)nh + nh->allocationSize);
-			if((uptr)nnh != largeAllocationEnd)
+			Header *nnh = nextHeader(nh);
+			if(nnh)
 				nnh->previousHeader = h;
 			// remove next header
 			removeHeader(nh);
@@ -295,8 +448,8 @@ void Heap::free(void *mem) {
 			// merge with previous header
 			h->previousHeader->allocationSize += h->allocationSize;
 			// adjust the pointer
-			Header *nh = (Header *)((uptr)h + h->allocationSize);
-			if((uptr)nh != largeAllocationEnd)
+			Header *nh = nextHeader(h->previousHeader);
+			if(nh)
 				nh->previousHeader = h->previousHeader;
 			h = h->previousHeader;
 		}
@@ -310,10 +463,9 @@ void Heap::free(void *mem) {
 			    h->allocationSize + ((uptr)h - largeAllocationStart);
 			newHeader->magic          = Header::Magic;
 			newHeader->previousHeader = NULL;
-			newHeader->left = newHeader->right = NULL;
 			// search for the next header
-			Header *nh = (Header *)(newHeader + newHeader->allocationSize);
-			if((uptr)nh < largeAllocationEnd) {
+			Header *nh = nextHeader(newHeader);
+			if(nh) {
 				// adjust its previous header
 				nh->previousHeader = newHeader;
 			}
@@ -324,125 +476,1059 @@ void Heap::free(void *mem) {
 	}
 }
 
-Heap::Bucket *Heap::allocBucket(siz size, siz cls) {
+void Heap::freeRemote(void *mem) {
+	if(!mem)
+		return;
+	HeapTrace::record(HeapTrace::Free, this, mem);
+	void *head;
+	do {
+		head          = remoteFrees;
+		*(void **)mem = head;
+	} while(!__sync_bool_compare_and_swap(&remoteFrees, head, mem));
+}
+
+void Heap::drainRemoteFrees() {
+	// detach the whole list at once, so the pushes which race with
+	// us go to a new list
+	void *mem = __sync_lock_test_and_set(&remoteFrees, NULL);
+	while(mem) {
+		void *next = *(void **)mem;
+		freeUnlocked(mem);
+		mem = next;
+	}
+}
+
+siz Heap::allocBulk(siz bytes, siz count, void **out) {
+	// the batch is sampled as a whole
+	if(HeapProfiler::Enabled)
+		HeapProfiler::sample(bytes * count);
+	ScopedLock sl(heapLock);
+	prepareAlloc();
+	siz n = 0;
+	if(bytes <= BlockEnd) {
+		// look up the class once, and empty one bucket after another
+		bytes         = blockNearest(bytes);
+		siz        cls = getSizeClass(bytes);
+		SizeClass &sc  = sizeClasses[cls];
+		while(n < count) {
+			Bucket *b = sc.partial;
+			if(!b) {
+				b = sc.empty ? popEmptyBucket(sc) : allocBucket(bytes);
+				if(!b)
+					break;
+				pushBucket(&sc.partial, b);
+			}
+			while(n < count && b->numAvailBlocks) {
+				out[n++] = b->allocateBlock();
+				countAlloc(smallCounters[cls], bytes);
+			}
+			if(b->numAvailBlocks == 0) {
+				unlinkBucket(&sc.partial, b);
+				pushBucket(&sc.full, b);
+			}
+		}
+	} else {
+		while(n < count && (out[n] = allocUnlocked(bytes))) n++;
+	}
+	// blocks which come from the free list of a bucket are in the
+	// reverse order of their release, so put them back in order.
+	// the batches are small, and mostly carved in order already.
+	for(siz i = 1; i < n; i++) {
+		void *m = out[i];
+		siz   j = i;
+		for(; j > 0 && (uptr)out[j - 1] > (uptr)m; j--) out[j] = out[j - 1];
+		out[j] = m;
+	}
+	for(siz i = 0; i < n; i++)
+		HeapTrace::record(HeapTrace::Alloc, this, out[i], bytes);
+	return n;
+}
+
+void Heap::freeBulk(void **mems, siz count) {
+	ScopedLock sl(heapLock);
+	// the free list of a bucket is a stack, so a batch in address
+	// order is pushed from its end, to pop out in order next time
+	for(siz i = count; i > 0; i--) {
+		HeapTrace::record(HeapTrace::Free, this, mems[i - 1]);
+		freeUnlocked(mems[i - 1]);
+	}
+}
+
+void *Heap::realloc(void *mem, siz bytes) {
+	if(!mem)
+		return alloc(bytes);
+	if(bytes == 0) {
+		free(mem);
+		return NULL;
+	}
+	siz    oldSize;
+	MemTag tag;
+	{
+		ScopedLock sl(heapLock);
+		// a tagged block is always moved, to a tagged one
+		tag = tagOf(mem);
+		if(tag == MemTag::None && resizeInPlace(mem, bytes)) {
+			HeapTrace::record(HeapTrace::Realloc, this, mem, bytes, (uptr)mem);
+			return mem;
+		}
+		oldSize = usableSize(mem);
+	}
+	// we need to move. the new block is taken and the old one is
+	// released under the lock, but the contents are copied without it.
+	if(HeapProfiler::Enabled)
+		HeapProfiler::sample(bytes);
+	void *newMem;
+	{
+		ScopedLock sl(heapLock);
+		prepareAlloc();
+		newMem = tag == MemTag::None ? allocUnlocked(bytes)
+		                             : allocTaggedUnlocked(bytes, tag, false);
+	}
+	if(!newMem)
+		return NULL;
+	memcpy(newMem, mem, oldSize < bytes ? oldSize : bytes);
+	ScopedLock sl(heapLock);
+	HeapTrace::record(HeapTrace::Realloc, this, newMem, bytes, (uptr)mem);
+	freeUnlocked(mem);
+	return newMem;
+}
+
+siz Heap::usableSize(void *mem) {
+	uptr addr = (uptr)mem;
+	if(addr < bucketAllocationEnd)
+		return buckets[getBucketIndex(addr)].blockSize;
+	if(addr < mediumAllocationEnd)
+		return getSpan(addr)->blockSize;
+	if(addr >= hugeAllocationStart) {
+		siz page = (addr - hugeAllocationStart) / Paging::PageSize;
+		return hugePages(hugeRuns[page]) * Paging::PageSize;
+	}
+	Header *h = (Header *)(addr - sizeof(Header));
+	// an aligned allocation may have started after the beginning
+	// of its header
+	return (uptr)h + h->allocationSize - addr;
+}
+
+bool Heap::resizeInPlace(void *mem, siz bytes) {
+	uptr addr = (uptr)mem;
+	if(addr < bucketAllocationEnd) {
+		// a block stays in its bucket as long as the new size
+		// belongs to the same size class, or it is shrinking
+		// by less than half of it
+		siz blockSize = buckets[getBucketIndex(addr)].blockSize;
+		return bytes <= blockSize && bytes > blockSize / 2;
+	}
+	if(addr < mediumAllocationEnd) {
+		// same for the spans
+		siz blockSize = getSpan(addr)->blockSize;
+		return bytes <= blockSize && bytes > blockSize / 2;
+	}
+	if(addr >= hugeAllocationStart)
+		return resizeHuge(mem, bytes);
+	Header *h = (Header *)(addr - sizeof(Header));
+	if(h->magic != (Header::Magic | 1)) {
+		Terminal::err("Invalid header magic!\n");
+		for(;;)
+			;
+	}
+	// if the allocation does not start right after the header,
+	// the offset is part of the space we need
+	bytes = roundUp8(bytes) + (addr - (uptr)h - sizeof(Header));
+	Header *nh      = nextHeader(h);
+	siz     oldSize = h->allocationSize;
+	if(bytes + sizeof(Header) > h->allocationSize) {
+		// we need to grow, which we can only do if the header
+		// next to us is free, and large enough
+		if(!nh || nh->magic != Header::Magic ||
+		   h->allocationSize + nh->allocationSize < bytes + sizeof(Header))
+			return false;
+	} else if(!nh || nh->magic != Header::Magic) {
+		// we are shrinking, and there is nothing to merge the tail
+		// with. so just break us up, if the tail is large enough.
+		splitHeader(h, bytes);
+		countResize(oldSize, h->allocationSize);
+		return true;
+	}
+	// merge the next free header into us, and then split
+	// off whatever we don't need.
+	removeHeader(nh);
+	h->allocationSize += nh->allocationSize;
+	Header *nnh = nextHeader(h);
+	if(nnh)
+		nnh->previousHeader = h;
+	splitHeader(h, bytes);
+	h->ensureMapped(directory, true);
+	touchLarge((uptr)h + h->allocationSize);
+	countResize(oldSize, h->allocationSize);
+	return true;
+}
+
+void *Heap::alloc(siz bytes, MagazineCache &cache) {
+	if(bytes == 0 || bytes > MagazineClasses * BlockWidth)
+		return alloc(bytes);
+	if(HeapProfiler::Enabled)
+		HeapProfiler::sample(bytes);
+	bytes       = blockNearest(bytes);
+	Magazine &m = cache.magazines[getSizeClass(bytes)];
+	if(m.count > 0) {
+		cache.allocHits++;
+		void *b = m.rounds[--m.count];
+		HeapTrace::record(HeapTrace::Alloc, this, b, bytes);
+		return b;
+	}
+	cache.allocMisses++;
+	// refill the magazine with a batch of blocks, one of which
+	// we keep for ourselves
+	ScopedLock sl(heapLock);
+	prepareAlloc();
+	while(m.count <= MagazineBatch) {
+		void *b = allocSmall(bytes);
+		if(!b)
+			break;
+		m.rounds[m.count++] = b;
+	}
+	// the buckets may run out during the refill, so the block is
+	// taken from whatever made it into the magazine
+	void *b = m.count > 0 ? m.rounds[--m.count] : NULL;
+	HeapTrace::record(HeapTrace::Alloc, this, b, bytes);
+	return b;
+}
+
+void Heap::free(void *mem, MagazineCache &cache) {
+	uptr addr = (uptr)mem;
+	if(!mem || addr >= bucketAllocationEnd) {
+		free(mem);
+		return;
+	}
+	// the bucket of an allocated block does not change its size,
+	// so it is safe to peek at it without the lock
+	siz bytes = buckets[getBucketIndex(addr)].blockSize;
+	if(bytes > MagazineClasses * BlockWidth) {
+		free(mem);
+		return;
+	}
+	HeapTrace::record(HeapTrace::Free, this, mem);
+	Magazine &m = cache.magazines[getSizeClass(bytes)];
+	if(m.count == MagazineSize) {
+		cache.freeMisses++;
+		// the magazine is full, so release the older half of it
+		// back to the buckets, and keep the recently freed ones
+		ScopedLock sl(heapLock);
+		for(siz i = 0; i < MagazineBatch; i++) freeSmall(m.rounds[i]);
+		for(siz i = MagazineBatch; i < MagazineSize; i++)
+			m.rounds[i - MagazineBatch] = m.rounds[i];
+		m.count -= MagazineBatch;
+	} else {
+		cache.freeHits++;
+	}
+	m.rounds[m.count++] = mem;
+}
+
+void Heap::drain(MagazineCache &cache) {
+	ScopedLock sl(heapLock);
+	for(siz c = 0; c < MagazineClasses; c++) {
+		Magazine &m = cache.magazines[c];
+		while(m.count > 0) freeSmall(m.rounds[--m.count]);
+	}
+}
+
+void Heap::MagazineCache::init() {
+	for(siz c = 0; c < MagazineClasses; c++) magazines[c].count = 0;
+	allocHits = allocMisses = 0;
+	freeHits = freeMisses = 0;
+}
+
+u32 Heap::MagazineCache::dump() const {
+	u32 cached = 0;
+	for(siz c = 0; c < MagazineClasses; c++) cached += magazines[c].count;
+	return Terminal::write("Magazine ( alloc hit: ", allocHits,
+	                       " miss: ", allocMisses, " free hit: ", freeHits,
+	                       " miss: ", freeMisses, " cached: ", cached, " )");
+}
+
+// the part of the free memory which is not in the largest block,
+// in parts per thousand
+static u32 fragmentation(siz largest, siz total) {
+	return total ? (u64)(total - largest) * 1000 / total : 0;
+}
+
+Heap::Stats Heap::stats() {
+	ScopedLock sl(heapLock);
+	Stats      st;
+	memset(&st, 0, sizeof(Stats));
+	if(!ready)
+		return st;
+	st.bytesInUse       = bytesInUse;
+	st.peakBytesInUse   = peakBytesInUse;
+	st.bucketsInUse     = bucketsInUse;
+	st.peakBucketsInUse = peakBucketsInUse;
+	st.numBuckets       = numBuckets;
+	st.emptyBuckets     = emptyBuckets;
+	st.spansInUse       = spansInUse;
+	st.peakSpansInUse   = peakSpansInUse;
+	st.numSpans         = numSpans;
+	st.numHugePages     = numHugePages;
+	for(u32 flm = firstLevelMap; flm; flm &= flm - 1) {
+		siz fl = Asm::bsf(flm);
+		for(u32 slm = secondLevelMap[fl]; slm; slm &= slm - 1) {
+			for(Header *h = freeHeaders[fl][Asm::bsf(slm)]; h;
+			    h         = h->nextFree) {
+				st.freeHeaders++;
+				st.largeFreeBytes += h->allocationSize;
+				if(h->allocationSize > st.largestFreeBlock)
+					st.largestFreeBlock = h->allocationSize;
+			}
+		}
+	}
+	for(siz page = 0; page < numHugePages;
+	    page += hugePages(hugeRuns[page])) {
+		siz pages = hugePages(hugeRuns[page]);
+		if(hugeRuns[page] & 1)
+			continue;
+		st.hugeFreePages += pages;
+		if(pages > st.largestHugeRun)
+			st.largestHugeRun = pages;
+	}
+	st.largeFragmentation =
+	    fragmentation(st.largestFreeBlock, st.largeFreeBytes);
+	st.hugeFragmentation = fragmentation(st.largestHugeRun, st.hugeFreePages);
+	return st;
+}
+
+u32 Heap::Stats::dump() const {
+	return Terminal::write(
+	    "in use: ", bytesInUse, " bytes ( peak: ", peakBytesInUse,
+	    " )\nbuckets: ", bucketsInUse, "/", numBuckets,
+	    " ( peak: ", peakBucketsInUse, " empty: ", emptyBuckets,
+	    " )\nspans: ", spansInUse, "/", numSpans, " ( peak: ", peakSpansInUse,
+	    " )\nlarge: ", freeHeaders, " free headers ( free: ", largeFreeBytes,
+	    " largest: ", largestFreeBlock, " fragmentation: ", largeFragmentation,
+	    "/1000 )\nhuge: ", hugeFreePages, "/", numHugePages,
+	    " pages free ( largest run: ", largestHugeRun,
+	    " fragmentation: ", hugeFragmentation, "/1000 )\n");
+}
+
+void Heap::classStats(ClassStats &cs) {
+	ScopedLock sl(heapLock);
+	memset(&cs, 0, sizeof(ClassStats));
+	if(!ready)
+		return;
+	for(siz i = 0; i < BlockCount; i++) {
+		cs.small[i].holders = sizeClasses[i].bucketCount;
+		cs.small[i].empty   = sizeClasses[i].emptyCount;
+		cs.small[i].allocs  = smallCounters[i].allocs;
+		cs.small[i].frees   = smallCounters[i].frees;
+	}
+	for(siz i = 0; i < MediumClassCount; i++) {
+		cs.medium[i].holders = mediumClasses[i].spanCount;
+		cs.medium[i].empty   = mediumClasses[i].emptyCount;
+		cs.medium[i].allocs  = mediumCounters[i].allocs;
+		cs.medium[i].frees   = mediumCounters[i].frees;
+	}
+	cs.large.allocs = largeCounter.allocs;
+	cs.large.frees  = largeCounter.frees;
+	cs.huge.allocs  = hugeCounter.allocs;
+	cs.huge.frees   = hugeCounter.frees;
+}
+
+u32 Heap::ClassStats::dump() const {
+	u32 res = 0;
+	for(siz i = 0; i < BlockCount; i++) {
+		if(!small[i].allocs)
+			continue;
+		res += Terminal::write((i + 1) * BlockWidth,
+		                       " ( buckets: ", small[i].holders,
+		                       " empty: ", small[i].empty,
+		                       " allocs: ", small[i].allocs,
+		                       " frees: ", small[i].frees, " )\n");
+	}
+	for(siz i = 0; i < MediumClassCount; i++) {
+		if(!medium[i].allocs)
+			continue;
+		res += Terminal::write(mediumClassSize(i),
+		                       " ( spans: ", medium[i].holders,
+		                       " empty: ", medium[i].empty,
+		                       " allocs: ", medium[i].allocs,
+		                       " frees: ", medium[i].frees, " )\n");
+	}
+	res += Terminal::write("large ( allocs: ", large.allocs,
+	                       " frees: ", large.frees,
+	                       " )\nhuge ( allocs: ", huge.allocs,
+	                       " frees: ", huge.frees, " )\n");
+	return res;
+}
+
+u32 Heap::dumpTags() {
+	ScopedLock sl(heapLock);
+	u32        res = 0;
+	if(!ready)
+		return res;
+	for(siz i = 1; i < (siz)MemTag::Count; i++) {
+		TagCounter &c = tagCounters[i];
+		if(!c.allocs)
+			continue;
+		res += Terminal::write(Memory::TagNames[i], " ( in use: ", c.bytesInUse,
+		                       " bytes peak: ", c.peakBytesInUse,
+		                       " allocs: ", c.allocs, " frees: ", c.frees,
+		                       " )\n");
+	}
+	return res;
+}
+
+Heap::Bucket *Heap::allocBucket(siz size) {
 	// try to check if we have a free bucket
 	Bucket *b = NULL;
 	if(freeBuckets) {
 		b           = freeBuckets;
 		freeBuckets = freeBuckets->nextBucket;
-		// map the page
-		Paging::getPage((uptr)b->startMem, false, directory)->alloc(true, true);
 		b->init(size);
-	} else {
-		if(bucketAllocationCurrent > bucketAllocationEnd) {
+		// map the page
+		b->zeroed = mapPage(b->startMem, directory);
+	} else if(bucketAllocationCurrent > bucketAllocationEnd) {
+		// we are out of buckets, so steal an empty one which is
+		// kept mapped by some other size class
+		for(siz i = 0; i < BlockCount && !b; i++) b = sizeClasses[i].empty;
+		if(!b) {
 			Terminal::err("No more memory to allocate a bucket!\n");
 			for(;;)
 				;
 		}
+		SizeClass &from = sizeClasses[getSizeClass(b->blockSize)];
+		popEmptyBucket(from);
+		from.bucketCount--;
+		b->init(size);
+		// its page is already dirty
+		b->zeroed = false;
+		sizeClasses[getSizeClass(size)].bucketCount++;
+		return b;
+	} else {
 		// try to allocate a new bucket
 		siz idx = getBucketIndex(bucketAllocationCurrent);
 		b       = &buckets[idx];
 		b       = Bucket::create(size, (uptr)b, bucketAllocationCurrent);
 		// if the page is not yet allocated, alloc it
-		Paging::getPage((uptr)bucketAllocationCurrent, true, directory)
-		    ->alloc(true, true);
+		b->zeroed = mapPage(bucketAllocationCurrent, directory);
 		bucketAllocationCurrent += BucketSize;
 	}
-	if(b == NULL)
-		return NULL;
-	b->nextBucket        = bucketClassList[cls];
-	bucketClassList[cls] = b;
+	sizeClasses[getSizeClass(size)].bucketCount++;
+	if(++bucketsInUse > peakBucketsInUse)
+		peakBucketsInUse = bucketsInUse;
 	return b;
 }
 
-Heap::Header *Heap::findClosestHeader(siz size, bool pageAlign) {
-	Header *lastFound = NULL;
-	size += sizeof(Header);
-	Header *search = headerRoot;
-	while(search) {
-		if(search->allocationSize >= size && search->magic == Header::Magic) {
-			if(pageAlign) {
-				// check if the header is page aligned
-				// check if the size criteria will still satisfy
-				// if we add blank space up until the next page
-				uptr bak = (uptr)search;
-				Paging::alignIfNeeded(bak);
-				// so, our target memory will start from bak, header will
-				// start from bak - sizeof(Header), and the whole
-				// thing will end at bak + size - sizeof(Header)
-				uptr end = bak + size - sizeof(Header);
-				// so we need at least this amount of memory
-				uptr total = end - (uptr)search;
-				// check if we have it
-				if(search->allocationSize >= total) {
-					// we do, fine
-					lastFound = search;
+void Heap::releaseBucket(Bucket *b) {
+	sizeClasses[getSizeClass(b->blockSize)].bucketCount--;
+	bucketsInUse--;
+	b->nextBucket = freeBuckets;
+	freeBuckets   = b;
+	// release the page back to the os
+	// we can only do this because we know
+	// startMem is page aligned and has size
+	// equal to the page size
+	Paging::resetPage(b->startMem, directory);
+}
+
+Heap::Bucket *Heap::popEmptyBucket(SizeClass &sc) {
+	Bucket *b = sc.empty;
+	unlinkBucket(&sc.empty, b);
+	sc.emptyCount--;
+	emptyBuckets--;
+	return b;
+}
+
+void Heap::releaseEmptyBuckets(siz target, siz keep) {
+	for(siz i = 0; i < BlockCount && emptyBuckets > target; i++) {
+		SizeClass &sc = sizeClasses[i];
+		while(sc.emptyCount > keep && emptyBuckets > target)
+			releaseBucket(popEmptyBucket(sc));
+	}
+}
+
+void Heap::setBucketRetention(siz perClass, siz low, siz high) {
+	ScopedLock sl(heapLock);
+	emptyPerClass      = perClass;
+	emptyLowWatermark  = low;
+	emptyHighWatermark = high;
+	if(emptyBuckets > emptyHighWatermark)
+		releaseEmptyBuckets(emptyLowWatermark, emptyPerClass);
+}
+
+void Heap::trim() {
+	ScopedLock sl(heapLock);
+	if(!ready)
+		return;
+	drainRemoteFrees();
+	releaseEmptyBuckets(0, 0);
+	for(siz i = 0; i < MediumClassCount; i++)
+		while(mediumClasses[i].empty)
+			releaseSpan(popEmptySpan(mediumClasses[i]));
+	trimFreeHeaders();
+}
+
+void Heap::trimFreeHeaders() {
+	for(u32 flm = firstLevelMap; flm; flm &= flm - 1) {
+		siz fl = Asm::bsf(flm);
+		for(u32 slm = secondLevelMap[fl]; slm; slm &= slm - 1) {
+			siz sl = Asm::bsf(slm);
+			for(Header *h = freeHeaders[fl][sl]; h; h = h->nextFree) {
+				uptr start = (uptr)h + sizeof(Header);
+				uptr end   = ((uptr)h + h->allocationSize) &
+				           ~(Paging::PageSize - 1);
+				Paging::alignIfNeeded(start);
+				for(uptr p = start; p < end; p += Paging::PageSize) {
+					Paging::Page *page = Paging::getPage(p, false, directory);
+					// the reserved ones are reset as well, so a stray
+					// access to the freed memory does not map it again
+					if(page && (page->inmem.frame || page->outmem.os_avail))
+						Paging::resetPage(p, directory);
 				}
-			} else
-				lastFound = search;
-		}
-		if(search->allocationSize >= size) {
-			search = search->left;
-		} else if(search->allocationSize < size) {
-			search = search->right;
+			}
 		}
 	}
-	return lastFound;
 }
 
-void Heap::insertHeader(Header *h) {
-	Header **pos = &headerRoot;
-	while(*pos) {
-		if((*pos)->allocationSize >= h->allocationSize) {
-			pos = &(*pos)->left;
+siz Heap::getMediumClass(siz size, siz align) {
+	// 2^p < size <= 2^(p + 1), and the classes in between are
+	// 'step' bytes apart
+	siz p    = Asm::bsr(size - 1);
+	siz step = ((siz)1 << p) / MediumClassesPerDoubling;
+	siz cls  = (p - MediumShift) * MediumClassesPerDoubling +
+	          (size - ((siz)1 << p) + step - 1) / step - 1;
+	// move up to a class whose blocks are all aligned. the last
+	// class is aligned to anything upto a page.
+	while(mediumClassSize(cls) & (align - 1)) cls++;
+	return cls;
+}
+
+void Heap::Span::init(siz cls) {
+	mediumClass    = cls;
+	blockSize      = mediumClassSize(cls);
+	numBlocks      = SpanSize / blockSize;
+	numAvailBlocks = numBlocks;
+	for(siz i = 0; i < SpanMapWords; i++) freeMap[i] = 0;
+	for(siz i = 0; i < numBlocks; i++) freeMap[i / 32] |= 1u << (i % 32);
+	nextSpan = NULL;
+	prevSpan = NULL;
+}
+
+Heap::Span *Heap::allocSpan(siz cls) {
+	Span *s = NULL;
+	if(freeSpans) {
+		s         = freeSpans;
+		freeSpans = freeSpans->nextSpan;
+	} else if(mediumAllocationCurrent < mediumAllocationEnd) {
+		s           = getSpan(mediumAllocationCurrent);
+		s->startMem = mediumAllocationCurrent;
+		mediumAllocationCurrent += SpanSize;
+	} else {
+		// we are out of spans, so steal an empty one which is
+		// kept mapped by some other class
+		for(siz i = 0; i < MediumClassCount && !s; i++)
+			s = mediumClasses[i].empty;
+		if(!s)
+			return NULL;
+		popEmptySpan(mediumClasses[s->mediumClass]);
+		mediumClasses[s->mediumClass].spanCount--;
+		s->init(cls);
+		// its pages are already dirty
+		s->zeroed = false;
+		mediumClasses[cls].spanCount++;
+		return s;
+	}
+	mediumClasses[cls].spanCount++;
+	if(++spansInUse > peakSpansInUse)
+		peakSpansInUse = spansInUse;
+	s->init(cls);
+	// none of its pages are mapped yet, so they come in zeroed
+	s->zeroed       = true;
+	s->carvedBlocks = 0;
+	return s;
+}
+
+void Heap::releaseSpan(Span *s) {
+	mediumClasses[s->mediumClass].spanCount--;
+	spansInUse--;
+	for(uptr p = s->startMem; p < s->startMem + SpanSize;
+	    p += Paging::PageSize) {
+		Paging::Page *page = Paging::getPage(p, false, directory);
+		if(page && page->inmem.frame)
+			Paging::resetPage(p, directory);
+	}
+	s->nextSpan = freeSpans;
+	freeSpans   = s;
+}
+
+Heap::Span *Heap::popEmptySpan(MediumClass &mc) {
+	Span *s = mc.empty;
+	unlinkSpan(&mc.empty, s);
+	mc.emptyCount--;
+	return s;
+}
+
+void *Heap::allocMedium(siz bytes, siz align, bool *zeroed) {
+	siz          cls = getMediumClass(bytes, align);
+	MediumClass &mc  = mediumClasses[cls];
+	Span        *s   = mc.partial;
+	if(!s) {
+		if(mc.empty)
+			s = popEmptySpan(mc);
+		else if(!(s = allocSpan(cls)))
+			return NULL;
+		pushSpan(&mc.partial, s);
+	}
+	// take the first free block
+	siz w = 0;
+	while(!s->freeMap[w]) w++;
+	siz i = w * 32 + Asm::bsf(s->freeMap[w]);
+	s->freeMap[w] &= ~(1u << (i % 32));
+	if(--s->numAvailBlocks == 0) {
+		// the span is full now
+		unlinkSpan(&mc.partial, s);
+		pushSpan(&mc.full, s);
+	}
+	if(zeroed)
+		*zeroed = s->zeroed && i >= s->carvedBlocks;
+	if(i >= s->carvedBlocks)
+		s->carvedBlocks = i + 1;
+	countAlloc(mediumCounters[cls], s->blockSize);
+	uptr m = s->startMem + i * s->blockSize;
+	for(uptr p = m & ~(Paging::PageSize - 1); p < m + s->blockSize;
+	    p += Paging::PageSize)
+		mapPage(p, directory);
+	return (void *)m;
+}
+
+void Heap::freeMedium(void *mem) {
+	uptr  addr = (uptr)mem;
+	Span *s    = getSpan(addr);
+	siz   off  = addr - s->startMem;
+	siz   i    = off / s->blockSize;
+	if(i * s->blockSize != off || i >= s->numBlocks ||
+	   (s->freeMap[i / 32] >> (i % 32)) & 1) {
+		Terminal::err("Invalid medium block!\n");
+		for(;;)
+			;
+	}
+	MediumClass &mc = mediumClasses[s->mediumClass];
+	countFree(mediumCounters[s->mediumClass], s->blockSize);
+	if(s->numAvailBlocks == 0) {
+		// it has a free block now
+		unlinkSpan(&mc.full, s);
+		pushSpan(&mc.partial, s);
+	}
+	s->freeMap[i / 32] |= 1u << (i % 32);
+	s->numAvailBlocks++;
+	if(s->isEmpty()) {
+		unlinkSpan(&mc.partial, s);
+		// spans are retained the same way as the buckets, but
+		// as they are much larger, they don't pile up beyond
+		// emptyPerClass
+		if(mc.emptyCount < emptyPerClass) {
+			pushSpan(&mc.empty, s);
+			mc.emptyCount++;
 		} else {
-			pos = &(*pos)->right;
+			releaseSpan(s);
 		}
 	}
-	*pos = h;
 }
 
-void Heap::removeHeader(Header *h, Header **slot) {
-	if(slot == NULL) {
-		slot = &headerRoot;
-		while(*slot != h) {
-			if(h->allocationSize > (*slot)->allocationSize)
-				slot = &(*slot)->right;
-			else
-				slot = &(*slot)->left;
-		}
+void Heap::pushSpan(Span **list, Span *s) {
+	s->prevSpan = NULL;
+	s->nextSpan = *list;
+	if(*list)
+		(*list)->prevSpan = s;
+	*list = s;
+}
+
+void Heap::unlinkSpan(Span **list, Span *s) {
+	if(s->nextSpan)
+		s->nextSpan->prevSpan = s->prevSpan;
+	if(s->prevSpan)
+		s->prevSpan->nextSpan = s->nextSpan;
+	else
+		*list = s->nextSpan;
+	s->nextSpan = s->prevSpan = NULL;
+}
+
+void Heap::pushBucket(Bucket **list, Bucket *b) {
+	b->prevBucket = NULL;
+	b->nextBucket = *list;
+	if(*list)
+		(*list)->prevBucket = b;
+	*list = b;
+}
+
+void Heap::unlinkBucket(Bucket **list, Bucket *b) {
+	if(b->nextBucket)
+		b->nextBucket->prevBucket = b->prevBucket;
+	if(b->prevBucket)
+		b->prevBucket->nextBucket = b->nextBucket;
+	else
+		*list = b->nextBucket;
+	b->nextBucket = b->prevBucket = NULL;
+}
+
+void Heap::mapHeaderSize(siz size, siz &fl, siz &sl) {
+	if(size < ((siz)1 << FirstLevelShift)) {
+		// small sizes are linearly divided in the first list
+		fl = 0;
+		sl = size >> (FirstLevelShift - SecondLevelBits);
+	} else {
+		siz msb = Asm::bsr(size);
+		// the second level is denoted by the next SecondLevelBits
+		// bits after the most significant bit
+		sl = (size >> (msb - SecondLevelBits)) ^ SecondLevelCount;
+		fl = msb - FirstLevelShift + 1;
 	}
-	if(h->left && h->right) {
-		// find the inorder successor
-		Header **childSlot    = &h->right;
-		Header  *inorder_succ = h->right;
-		while(inorder_succ->left) {
-			childSlot    = &inorder_succ->left;
-			inorder_succ = inorder_succ->left;
+}
+
+Heap::Header *Heap::findClosestHeader(siz size, bool pageAlign) {
+	size += sizeof(Header);
+	// for a page aligned allocation, the header may need to move
+	// at most a page forward, so make sure we have room for that
+	if(pageAlign)
+		size += Paging::PageSize;
+	// every header in a list is at least as large as the lower bound
+	// of the list, so round the size up to the next list, so that
+	// the first header of any list we find will be large enough
+	siz search = size;
+	if(search >= ((siz)1 << FirstLevelShift))
+		search += ((siz)1 << (Asm::bsr(search) - SecondLevelBits)) - 1;
+	siz fl, sl;
+	mapHeaderSize(search, fl, sl);
+	if(fl < FirstLevelCount) {
+		u32 slMap = secondLevelMap[fl] & (~(u32)0 << sl);
+		if(!slMap) {
+			// search in the larger first levels
+			u32 flMap = firstLevelMap & (~(u32)0 << (fl + 1));
+			if(flMap) {
+				fl    = Asm::bsf(flMap);
+				slMap = secondLevelMap[fl];
+			}
 		}
-		// remove the successor from where it was
-		removeHeader(inorder_succ, childSlot);
-		// assign it here
-		*slot = inorder_succ;
-		// adjust the children
-		inorder_succ->left  = h->left;
-		inorder_succ->right = h->right;
-	} else if(h->left || h->right) {
-		Header *node = h->left == NULL ? h->right : h->left;
-		*slot        = node;
+		if(slMap)
+			return freeHeaders[fl][Asm::bsf(slMap)];
+	}
+	// none of the larger lists contains a header, but the list
+	// of this very size may still contain one which is large
+	// enough. this is only checked when we're going to fail anyway.
+	mapHeaderSize(size, fl, sl);
+	for(Header *h = freeHeaders[fl][sl]; h; h = h->nextFree) {
+		if(h->allocationSize >= size)
+			return h;
+	}
+	return NULL;
+}
+
+void Heap::insertHeader(Header *h) {
+	siz fl, sl;
+	mapHeaderSize(h->allocationSize, fl, sl);
+	Header *head = freeHeaders[fl][sl];
+	h->prevFree  = NULL;
+	h->nextFree  = head;
+	if(head)
+		head->prevFree = h;
+	freeHeaders[fl][sl] = h;
+	firstLevelMap |= (u32)1 << fl;
+	secondLevelMap[fl] |= (u32)1 << sl;
+}
+
+void Heap::removeHeader(Header *h) {
+	siz fl, sl;
+	mapHeaderSize(h->allocationSize, fl, sl);
+	if(h->nextFree)
+		h->nextFree->prevFree = h->prevFree;
+	if(h->prevFree) {
+		h->prevFree->nextFree = h->nextFree;
 	} else {
-		*slot = NULL;
+		freeHeaders[fl][sl] = h->nextFree;
+		// if the list became empty, clear its bits
+		if(!h->nextFree) {
+			secondLevelMap[fl] &= ~((u32)1 << sl);
+			if(!secondLevelMap[fl])
+				firstLevelMap &= ~((u32)1 << fl);
+		}
 	}
-	// finally, clear the left right pointers of the header
-	h->left = h->right = NULL;
+	// finally, clear the list pointers of the header
+	h->nextFree = h->prevFree = NULL;
+}
+
+void Heap::splitHeader(Header *h, siz bytes) {
+	// we'll only break a header if it contains enough space to allocate
+	// a new huge object, i.e. of size BlockEnd + 1
+	if(h->allocationSize <= bytes + sizeof(Header) + BlockEnd)
+		return;
+	Header *nh = (Header *)((uptr)h + sizeof(Header) + bytes);
+	nh->ensureMapped(directory);
+	nh->magic          = Header::Magic;
+	nh->previousHeader = h;
+	nh->allocationSize = h->allocationSize - bytes - sizeof(Header);
+	// the header after the new one now has it as its previous
+	Header *next = nextHeader(nh);
+	if(next)
+		next->previousHeader = nh;
+	touchLarge((uptr)nh + sizeof(Header));
+	// insert the new header
+	insertHeader(nh);
+	// adjust the old header
+	h->allocationSize = bytes + sizeof(Header);
 }
 
 void Heap::Header::ensureMapped(Paging::Directory *directory, bool full) {
-	// map the first page
-	Paging::getPage((uptr)this, true, directory)->alloc(true, true);
-	if(full) {
-		for(uptr i = (uptr)this + Paging::PageSize;
-		    i < (uptr)this + allocationSize; i += Paging::PageSize)
-			Paging::getPage(i, true, directory)->alloc(true, true);
+	// map every page the header overlaps. 'this' need not be page
+	// aligned, so walk the page starts.
+	uptr end = (uptr)this + sizeof(Header);
+	for(uptr i = (uptr)this & ~(Paging::PageSize - 1); i < end;
+	    i += Paging::PageSize)
+		mapPage(i, directory);
+	// the rest of the allocation is only mapped when it is touched
+	if(full)
+		reservePages(end, (uptr)this + allocationSize, directory);
+}
+
+bool Heap::mapPage(uptr address, Paging::Directory *directory) {
+	Paging::Page *p = Paging::getPage(address, true, directory);
+	if(p->inmem.frame)
+		return false;
+	p->alloc(true, true);
+	// the frame may have been used before, so clear it
+	memset((void *)(address & ~(Paging::PageSize - 1)), 0, Paging::PageSize);
+	return true;
+}
+
+void Heap::reservePages(uptr start, uptr end, Paging::Directory *directory) {
+	for(uptr i = start & ~(Paging::PageSize - 1); i < end;
+	    i += Paging::PageSize) {
+		Paging::Page *p = Paging::getPage(i, true, directory);
+		if(!p->inmem.frame)
+			p->outmem.os_avail = 1;
+	}
+}
+
+void Heap::prefault(void *mem, siz bytes) {
+	for(uptr i = (uptr)mem & ~(Paging::PageSize - 1); i < (uptr)mem + bytes;
+	    i += Paging::PageSize)
+		Paging::faultIn(i, directory);
+}
+
+void Heap::setHugeRun(siz page, siz pages, bool used, MemTag tag) {
+	hugeRuns[page]             = hugeTag(pages, used, tag);
+	hugeRuns[page + pages - 1] = hugeTag(pages, used, tag);
+}
+
+void Heap::freeHugeRun(siz page, siz pages) {
+	// merge with the next run, if it is free
+	if(page + pages < numHugePages && !(hugeRuns[page + pages] & 1))
+		pages += hugePages(hugeRuns[page + pages]);
+	// and with the previous one, whose last tag is right before us
+	if(page > 0 && !(hugeRuns[page - 1] & 1)) {
+		siz prev = hugePages(hugeRuns[page - 1]);
+		page -= prev;
+		pages += prev;
+	}
+	setHugeRun(page, pages, false);
+}
+
+void Heap::reserveHugePages(siz page, siz pages) {
+	uptr start = hugeAllocationStart + page * Paging::PageSize;
+	uptr end   = start + pages * Paging::PageSize;
+	// a run gets a region of its own, so that its pages are not
+	// walked, unless the directory is out of them
+	if(!Paging::addRegion(start, end, Paging::Region::DemandZero, directory))
+		reservePages(start, end, directory);
+}
+
+void *Heap::allocHuge(siz bytes, siz align) {
+	siz pages = (bytes + Paging::PageSize - 1) / Paging::PageSize;
+	// first fit, walking the runs in address order. 'skip' is the
+	// number of pages at the start of a run before an aligned one.
+	siz page = 0, skip = 0;
+	for(; page < numHugePages; page += hugePages(hugeRuns[page])) {
+		if(hugeRuns[page] & 1)
+			continue;
+		uptr start = hugeAllocationStart + page * Paging::PageSize;
+		skip = (((start + align - 1) & -align) - start) / Paging::PageSize;
+		if(skip + pages <= hugePages(hugeRuns[page]))
+			break;
+	}
+	if(page >= numHugePages)
+		return NULL;
+	siz runPages = hugePages(hugeRuns[page]);
+	if(skip) {
+		// leave the unaligned pages free, before us
+		setHugeRun(page, skip, false);
+		page += skip;
+		runPages -= skip;
+	}
+	setHugeRun(page, pages, true);
+	if(runPages > pages)
+		setHugeRun(page + pages, runPages - pages, false);
+	// free runs are never mapped, so all of the pages are reserved
+	reserveHugePages(page, pages);
+	countAlloc(hugeCounter, pages * Paging::PageSize);
+	return (void *)(hugeAllocationStart + page * Paging::PageSize);
+}
+
+void Heap::freeHuge(void *mem) {
+	uptr addr = (uptr)mem;
+	siz  page = (addr - hugeAllocationStart) / Paging::PageSize;
+	if((addr & (Paging::PageSize - 1)) || !(hugeRuns[page] & 1)) {
+		Terminal::err("Invalid huge allocation!\n");
+		for(;;)
+			;
+	}
+	siz    pages = hugePages(hugeRuns[page]);
+	MemTag tag   = hugeMemTag(hugeRuns[page]);
+	countFree(hugeCounter, pages * Paging::PageSize);
+	if(tag != MemTag::None)
+		countTagFree(tag, pages * Paging::PageSize);
+	Paging::Region *r = Paging::findRegion(addr, directory);
+	if(r)
+		Paging::removeRegion(r);
+	// return all the frames
+	for(siz i = 0; i < pages; i++)
+		Paging::resetPage(addr + i * Paging::PageSize, directory);
+	freeHugeRun(page, pages);
+}
+
+bool Heap::resizeHuge(void *mem, siz bytes) {
+	uptr addr     = (uptr)mem;
+	siz  page     = (addr - hugeAllocationStart) / Paging::PageSize;
+	siz  pages    = hugePages(hugeRuns[page]);
+	siz  newPages = (bytes + Paging::PageSize - 1) / Paging::PageSize;
+	// a huge allocation does not shrink into a smaller tier
+	if(bytes <= MediumEnd)
+		return false;
+	Paging::Region *r = Paging::findRegion(addr, directory);
+	if(newPages < pages) {
+		if(r)
+			Paging::resizeRegion(r, addr + newPages * Paging::PageSize);
+		// give the frames of the tail back
+		for(siz i = newPages; i < pages; i++)
+			Paging::resetPage(addr + i * Paging::PageSize, directory);
+		setHugeRun(page, newPages, true);
+		freeHugeRun(page + newPages, pages - newPages);
+	} else if(newPages > pages) {
+		// grow into the next run, if it is free and large enough
+		siz next = page + pages;
+		if(next >= numHugePages || (hugeRuns[next] & 1) ||
+		   hugePages(hugeRuns[next]) < newPages - pages)
+			return false;
+		siz nextPages = hugePages(hugeRuns[next]);
+		setHugeRun(page, newPages, true);
+		if(nextPages > newPages - pages)
+			setHugeRun(page + newPages, nextPages - (newPages - pages),
+			           false);
+		// the run keeps a single region, or none at all
+		if(r)
+			Paging::resizeRegion(r, addr + newPages * Paging::PageSize);
+		else
+			reservePages(addr + pages * Paging::PageSize,
+			             addr + newPages * Paging::PageSize, directory);
+	}
+	countResize(pages * Paging::PageSize, newPages * Paging::PageSize);
+	return true;
+}
+
+void Heap::zeroLarge(void *mem, siz bytes, uptr touched) {
+	// whatever lies after 'touched' is still zero
+	uptr start = (uptr)mem;
+	uptr end   = start + bytes;
+	if(end > touched)
+		end = touched;
+	if(start < end)
+		memset(mem, 0, end - start);
+}
+
+void *Heap::calloc(siz count, siz size) {
+	if(size && count > Limits::SizMax / size)
+		return NULL;
+	siz bytes = count * size;
+	if(HeapProfiler::Enabled)
+		HeapProfiler::sample(bytes);
+	ScopedLock sl(heapLock);
+	prepareAlloc();
+	void *m = callocUnlocked(bytes);
+	HeapTrace::record(HeapTrace::Calloc, this, m, bytes);
+	return m;
+}
+
+void *Heap::callocUnlocked(siz bytes) {
+	if(bytes <= BlockEnd) {
+		bool  zeroed;
+		void *m = allocSmall(bytes, &zeroed);
+		if(m && !zeroed)
+			memset(m, 0, blockNearest(bytes));
+		return m;
+	}
+	if(bytes <= MediumEnd) {
+		bool  zeroed;
+		void *m = allocMedium(bytes, BlockWidth, &zeroed);
+		if(m) {
+			if(!zeroed)
+				memset(m, 0, bytes);
+			return m;
+		}
+	}
+	void *m = allocHuge(bytes);
+	if(m)
+		return m;
+	uptr touched = largeTouched;
+	m            = allocLarge(bytes);
+	zeroLarge(m, bytes, touched);
+	return m;
+}
+
+void *Heap::calloc_a(siz bytes) {
+	if(HeapProfiler::Enabled)
+		HeapProfiler::sample(bytes);
+	ScopedLock sl(heapLock);
+	prepareAlloc();
+	void *m = allocAligned(bytes, Paging::PageSize, true);
+	HeapTrace::record(HeapTrace::Calloc, this, m, bytes, Paging::PageSize);
+	return m;
+}
+
+void *Heap::allocTagged(siz bytes, MemTag tag, bool zero) {
+	if(bytes == 0)
+		return NULL;
+	if(HeapProfiler::Enabled)
+		HeapProfiler::sample(bytes);
+	ScopedLock sl(heapLock);
+	prepareAlloc();
+	void *m = allocTaggedUnlocked(bytes, tag, zero);
+	HeapTrace::record(zero ? HeapTrace::Calloc : HeapTrace::AllocAligned, this,
+	                  m, bytes, Paging::PageSize);
+	return m;
+}
+
+void *Heap::allocTaggedUnlocked(siz bytes, MemTag tag, bool zero) {
+	// the pages of a huge run are always zero
+	void *m = allocHuge(bytes);
+	if(m) {
+		siz page  = ((uptr)m - hugeAllocationStart) / Paging::PageSize;
+		siz pages = hugePages(hugeRuns[page]);
+		setHugeRun(page, pages, true, tag);
+		countTagAlloc(tag, pages * Paging::PageSize);
+		return m;
+	}
+	uptr touched = largeTouched;
+	m            = allocLargeAligned(bytes);
+	if(zero)
+		zeroLarge(m, bytes, touched);
+	Header *h = (Header *)((uptr)m - sizeof(Header));
+	h->tag    = tag;
+	countTagAlloc(tag, h->allocationSize);
+	return m;
+}
+
+MemTag Heap::tagOf(void *mem) {
+	uptr addr = (uptr)mem;
+	if(addr < mediumAllocationEnd)
+		return MemTag::None;
+	if(addr >= hugeAllocationStart) {
+		siz page = (addr - hugeAllocationStart) / Paging::PageSize;
+		return hugeMemTag(hugeRuns[page]);
 	}
+	return ((Header *)(addr - sizeof(Header)))->tag;
 }
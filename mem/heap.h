@@ -1,5 +1,6 @@
 #pragma once
 
+#include <mem/memory.h>
 #include <mem/paging.h>
 #include <sched/spinlock.h>
 #include <sys/myos.h>
@@ -44,10 +45,14 @@ struct Heap {
 		uptr lastBlock;
 		// size of the blocks in this bucket
 		siz blockSize;
-		// pointer to the next bucket in
-		// the same arena of the same
+		// set if the page was zeroed when it was mapped, so that
+		// the blocks which are not carved out yet are all zero
+		bool zeroed;
+		// pointers to the neighboring buckets
+		// in the same list of the same
 		// size class
 		struct Bucket *nextBucket;
+		struct Bucket *prevBucket;
 		// will return NULL if the bucket
 		// does not have any more block
 		// to allocate
@@ -86,8 +91,39 @@ struct Heap {
 			blockSize      = blockSiz;
 			numAvailBlocks = BucketSize / blockSiz;
 			nextBucket     = nullptr;
+			prevBucket     = nullptr;
 			nextBlock      = nullptr;
 		}
+
+		bool isEmpty() const {
+			return numAvailBlocks == BucketSize / blockSize;
+		}
+	};
+
+	// magazines sit in front of the smaller size classes. a magazine
+	// is a bounded stack of free blocks of one size class, owned by a
+	// single task, so it can be popped and pushed without taking
+	// heapLock. it is refilled from, and drained to, the buckets in
+	// batches of MagazineBatch blocks, under the lock.
+	static const siz MagazineSize    = 8;
+	static const siz MagazineBatch   = MagazineSize / 2;
+	static const siz MagazineClasses = 32; // i.e. blocks upto 256 bytes
+	struct Magazine {
+		siz   count; // number of blocks in 'rounds'
+		void *rounds[MagazineSize];
+	};
+	// a set of magazines, one for each cached size class.
+	// it must only be used by the task it belongs to.
+	struct MagazineCache {
+		Magazine magazines[MagazineClasses];
+		// counters to measure the hit rate of the cache
+		u32 allocHits;   // served directly from a magazine
+		u32 allocMisses; // required a refill from the buckets
+		u32 freeHits;    // pushed directly to a magazine
+		u32 freeMisses;  // required a drain to the buckets
+
+		void init();
+		u32  dump() const;
 	};
 
 	static const siz KHeapStart = 0xD0000000;
@@ -102,8 +138,8 @@ struct Heap {
 	uptr heapStart; // start of the heap
 	uptr heapEnd;   // end of the heap
 	// this is the ratio of memory shared between buckets
-	// and large allocations. buckets get total / BucketRatio
-	// amount of memory. rest is given to large allocs.
+	// and the rest. buckets get total / BucketRatio amount
+	// of memory. rest is shared by spans and large allocs.
 	static const siz BucketRatio = 2;
 	// Among the total heap, this denotes how much memory
 	// can be used for buckets
@@ -115,9 +151,45 @@ struct Heap {
 	// chunk at an address will belong to one of the buckets
 	// in this array by following some linear calculations
 	Bucket *buckets;
-	// Linked list of buckets sorted by size class
-	Bucket *bucketClassList[BlockCount];
-	Bucket *freeBuckets; // linked list of free buckets
+	// buckets of a size class, separated by the state of their
+	// blocks. a bucket is moved between these lists in O(1)
+	// whenever it transitions from one state to another, so
+	// an allocation always finds a bucket with a free block
+	// at the head of 'partial'.
+	struct SizeClass {
+		Bucket *partial; // some of the blocks are allocated
+		Bucket *full;    // all of the blocks are allocated
+		// none of the blocks are allocated, but the bucket
+		// is still mapped, so that an alloc/free pair at the
+		// boundary of a bucket does not map and unmap it each time.
+		Bucket *empty;
+		siz     emptyCount;
+		siz     bucketCount; // in all three of the lists
+	};
+	SizeClass sizeClasses[BlockCount];
+	Bucket   *freeBuckets; // linked list of free buckets
+
+	// retention of the empty buckets. each class keeps upto
+	// emptyPerClass of them no matter what. above that, empty
+	// buckets pile up until the heap holds more than
+	// emptyHighWatermark of them, and then the surplus is
+	// released down to emptyLowWatermark.
+	static const siz DefaultEmptyPerClass      = 1;
+	static const siz DefaultEmptyLowWatermark  = 4;
+	static const siz DefaultEmptyHighWatermark = 16;
+
+	siz emptyBuckets; // number of empty buckets in all the classes
+	siz emptyPerClass;
+	siz emptyLowWatermark;
+	siz emptyHighWatermark;
+	// takes an empty bucket off sc.empty
+	Bucket *popEmptyBucket(SizeClass &sc);
+	// releases empty buckets, leaving at least 'keep' in each class,
+	// until at most 'target' of them are left in the heap
+	void releaseEmptyBuckets(siz target, siz keep);
+	// doubly linked list operations on the bucket lists
+	static void pushBucket(Bucket **list, Bucket *b);
+	static void unlinkBucket(Bucket **list, Bucket *b);
 	// all of the pointers below must be aligned on page boundaries
 
 	// this is the place from where chunk of memory is
@@ -135,15 +207,123 @@ struct Heap {
 		       12; // log2(size of each bucket)
 	}
 
-	Bucket *allocBucket(siz blockSize, siz cls);
+	// returns a new bucket of the given block size, which
+	// is not part of any list yet
+	Bucket *allocBucket(siz blockSize);
+	// releases a bucket back to freeBuckets, unmapping its page
+	void releaseBucket(Bucket *b);
+	// allocates a block from b, which must be in sc.partial.
+	// if zeroed is given, it is set when the block is known to
+	// be all zero.
+	void *allocFromBucket(SizeClass &sc, Bucket *b, bool *zeroed = NULL);
+	// allocate and release a block of a bucket size class.
+	// they don't acquire heapLock, that is upto the caller.
+	void *allocSmall(siz bytes, bool *zeroed = NULL);
+	void  freeSmall(void *mem);
+
+	// allocations above BlockEnd, upto MediumEnd bytes, are served
+	// from spans. a span is a SpanSize chunk of the medium region,
+	// which is split into equal blocks of one of the medium size
+	// classes. the classes grow geometrically, with
+	// MediumClassesPerDoubling of them between two powers of 2,
+	// so a block wastes at most a fifth of itself. the pages of a
+	// span are only mapped as its blocks are given out.
+	static const siz MediumEnd                = 64 * 1024;
+	static const siz MediumShift              = 10; // log2(BlockEnd)
+	static const siz MediumClassesPerDoubling = 4;
+	static const siz MediumClassCount         = 24; // 1 KiB to 64 KiB
+	static const siz SpanSize                 = 64 * 1024;
+	// maximum number of blocks in a span, i.e. SpanSize / 1280
+	static const siz SpanMapWords = 2;
+	// this is the ratio of memory given to the spans, out of the
+	// memory which is left after the buckets
+	static const siz MediumRatio = 2;
+
+	struct Span {
+		uptr startMem;
+		siz  blockSize;
+		u16  numBlocks;
+		u16  numAvailBlocks;
+		// blocks from here on have never been given out since the
+		// span was mapped, so they are still zero, if 'zeroed'
+		u16  carvedBlocks;
+		bool zeroed;
+		u8   mediumClass;
+		// a bit is set for every free block
+		u32   freeMap[SpanMapWords];
+		Span *nextSpan;
+		Span *prevSpan;
+
+		void init(siz cls);
+		bool isEmpty() const {
+			return numAvailBlocks == numBlocks;
+		}
+	};
+	// lists of spans of a medium class, the same way as SizeClass
+	struct MediumClass {
+		Span *partial;
+		Span *full;
+		Span *empty;
+		siz   emptyCount;
+		siz   spanCount;
+	};
+	MediumClass mediumClasses[MediumClassCount];
+	siz         numSpans;          // number of spans in this heap
+	siz         spanAdditionalMem; // memory for the span structures
+	Span       *spans;
+	Span       *freeSpans; // spans which are not used by any class
+	// beginning of the medium region
+	uptr mediumAllocationStart;
+	// next span in the medium region which is never used
+	uptr mediumAllocationCurrent;
+	// end of the medium region, exclusive
+	uptr mediumAllocationEnd;
+
+	// finds the medium class for a size, whose blocks are all
+	// aligned to 'align', which must not be larger than a page
+	static siz getMediumClass(siz size, siz align = BlockWidth);
+	static siz mediumClassSize(siz cls) {
+		siz shift = cls / MediumClassesPerDoubling;
+		return (BlockEnd << shift) +
+		       (cls % MediumClassesPerDoubling + 1) * (BlockEnd << shift) /
+		           MediumClassesPerDoubling;
+	}
+	Span *getSpan(uptr address) {
+		return &spans[(address - mediumAllocationStart) / SpanSize];
+	}
+	// returns a span which is not part of any list yet, or NULL
+	// if the medium region is exhausted
+	Span *allocSpan(siz cls);
+	// unmaps the pages of the span and puts it in freeSpans
+	void  releaseSpan(Span *s);
+	Span *popEmptySpan(MediumClass &mc);
+	static void pushSpan(Span **list, Span *s);
+	static void unlinkSpan(Span **list, Span *s);
+	// allocate and release a block of a medium class. allocMedium
+	// returns NULL if there is no span left for the class, in which
+	// case the allocation falls back to the headers. they don't
+	// acquire heapLock, that is upto the caller.
+	void *allocMedium(siz bytes, siz align = BlockWidth, bool *zeroed = NULL);
+	void  freeMedium(void *mem);
+
 	// beginning of large memory allocation
 	uptr largeAllocationStart;
 	// end of the same
 	uptr largeAllocationEnd;
+	// end of the part of the large region which has ever been given
+	// out or written a header to. as pages are zeroed when they are
+	// mapped, everything after this is known to be zero.
+	uptr largeTouched;
+	void touchLarge(uptr end) {
+		if(end > largeTouched)
+			largeTouched = end;
+	}
+	// zeroes mem, which was allocated when largeTouched was 'touched'
+	static void zeroLarge(void *mem, siz bytes, uptr touched);
 
 	// structures to manage huge memory allocations.
-	// the free headers form a binary tree. as well
-	// as, they keep track of their neighbors.
+	// the free headers are kept in segregated free lists, and
+	// they also keep track of their neighbors.
 	// nextHeader = (uptr)header + allocationSize;
 	struct Header {
 		static const u32 Magic = 0x48454144; // HEAD
@@ -152,20 +332,119 @@ struct Heap {
 		siz     allocationSize; // including the header
 		Header *previousHeader; // previous header in memory
 
-		Header *left;
-		Header *right;
+		// neighbors in the free list this header belongs to. a
+		// header in use is in no list, so it keeps its tag instead.
+		Header *nextFree;
+		union {
+			Header *prevFree;
+			MemTag  tag;
+		};
 
 		// ensures that the page this header belongs is
-		// mapped already. If full is true, this ensures
-		// that all the pages upto allocationSize is mapped
+		// mapped already. If full is true, this also reserves
+		// all the pages upto allocationSize, which are then
+		// mapped as they are touched.
 		void ensureMapped(Paging::Directory *directory, bool full = false);
 	};
 
-	// only free headers are kept in the tree.
-	Header *headerRoot;
+	// free headers are indexed by a two level segregated fit (TLSF)
+	// scheme. the first level divides the sizes in powers of 2, and
+	// the second level divides each of those ranges linearly into
+	// SecondLevelCount lists. a bit is set in the bitmaps for every
+	// list that is not empty, so a fitting list is found using a
+	// couple of bsf's, in constant time.
+	static const siz SecondLevelBits  = 4;
+	static const siz SecondLevelCount = 1 << SecondLevelBits;
+	// all sizes below 1 << FirstLevelShift are kept in first level 0
+	static const siz FirstLevelShift = 10; // log2(BlockEnd)
+	static const siz FirstLevelCount = 32 - FirstLevelShift + 1;
+
+	u32     firstLevelMap;
+	u32     secondLevelMap[FirstLevelCount];
+	Header *freeHeaders[FirstLevelCount][SecondLevelCount];
+	// finds the list a header of the given size belongs to
+	static void mapHeaderSize(siz size, siz &fl, siz &sl);
+
 	Header *findClosestHeader(siz size, bool pageAlign = false);
 	void    insertHeader(Header *h);
-	void    removeHeader(Header *h, Header **slot = NULL);
+	void    removeHeader(Header *h);
+	// returns the header next to h in memory, NULL if h is the last one
+	Header *nextHeader(Header *h) {
+		uptr n = (uptr)h + h->allocationSize;
+		return n == largeAllocationEnd ? NULL : (Header *)n;
+	}
+	// unmaps the pages which lie wholly inside the free headers,
+	// keeping the ones the headers themselves are on. they are
+	// mapped again, zeroed, when the memory is touched after it is
+	// allocated. it does not acquire heapLock.
+	void trimFreeHeaders();
+	// breaks h after 'bytes' bytes of allocation, if the rest of it
+	// is large enough to contain a large allocation
+	void splitHeader(Header *h, siz bytes);
+	// dispatches an aligned allocation to the tiers, zeroing
+	// it if asked to. it does not acquire heapLock.
+	void *allocAligned(siz bytes, siz align, bool zero);
+	// allocate from the headers. they don't acquire heapLock.
+	void *allocLarge(siz bytes);
+	void *allocLargeAligned(siz bytes);
+
+	// allocations above MediumEnd are huge. they get a page granular
+	// range of their own in the huge region, whose pages are reserved
+	// when it is allocated, mapped as they are touched, and unmapped,
+	// returning the frames, when it is freed. the ranges are described
+	// out of band, by a pair of tags at the first and the last page of
+	// each run of pages, holding the length of the run and whether it
+	// is in use. as the tags are not kept in the pages themselves,
+	// free runs stay unmapped.
+	static const siz HugeRatio = 2; // of what is left after the spans
+
+	siz  numHugePages;
+	siz  hugeAdditionalMem; // memory for the tags
+	u32 *hugeRuns;
+	uptr hugeAllocationStart;
+	uptr hugeAllocationEnd; // exclusive
+	// the memory tag of a run in use is kept in the top byte, so a
+	// run can be at most 8M pages long
+	static const siz HugeMemTagShift = 24;
+
+	static u32 hugeTag(siz pages, bool used, MemTag tag) {
+		return ((u32)tag << HugeMemTagShift) | (pages << 1) | used;
+	}
+	static siz hugePages(u32 tag) {
+		return (tag & ((1 << HugeMemTagShift) - 1)) >> 1;
+	}
+	static MemTag hugeMemTag(u32 tag) {
+		return (MemTag)(tag >> HugeMemTagShift);
+	}
+	// marks pages [page, page + pages) as a single run
+	void setHugeRun(siz page, siz pages, bool used,
+	                MemTag tag = MemTag::None);
+	// marks the run as free, merging it with its free neighbors
+	void freeHugeRun(siz page, siz pages);
+	// reserves pages [page, page + pages), as a region of the
+	// directory if it has one left
+	void reserveHugePages(siz page, siz pages);
+	// they don't acquire heapLock. allocHuge returns NULL if there
+	// is no run large enough left, in which case the allocation
+	// falls back to the headers. the pages it returns are always
+	// zero, as they are only mapped when they are first touched.
+	void *allocHuge(siz bytes, siz align = Paging::PageSize);
+	void  freeHuge(void *mem);
+	bool  resizeHuge(void *mem, siz bytes);
+
+	// maps the page containing address in the given directory, if it
+	// is not mapped already, and zeroes it. the directory must be the
+	// current one, unless the page is shared with the kernel
+	// directory. returns true if the page was newly mapped.
+	static bool mapPage(uptr address, Paging::Directory *directory);
+	// reserves the pages in [start, end) which are not mapped, so
+	// that they are mapped to zeroed frames on their first access.
+	// this only takes address space, no frames.
+	static void reservePages(uptr start, uptr end,
+	                         Paging::Directory *directory);
+	// maps every reserved page of an allocation right away, for the
+	// callers which know they are going to write all of it
+	void prefault(void *mem, siz size);
 	// round up to next multiple of 8
 	static constexpr siz roundUp8(siz value) {
 		return ((value + 7) & -8);
@@ -173,12 +452,227 @@ struct Heap {
 
 	// main allocation functions
 	void *alloc(siz size);
-	void *alloc_a(siz size);
+	void *alloc_a(siz size); // page aligned
+	// dispatch to the tiers. they don't acquire heapLock.
+	void *allocUnlocked(siz size);
+	void  freeUnlocked(void *mem);
+	// allocates upto 'count' blocks of 'size' bytes each into 'out',
+	// in the order of their addresses, taking heapLock only once.
+	// returns the number of blocks allocated, which is less than
+	// count only when the heap runs out of memory.
+	siz allocBulk(siz size, siz count, void **out);
+	// frees 'count' blocks, taking heapLock only once
+	void freeBulk(void **mems, siz count);
+	// allocates 'size' bytes aligned to 'align', which must be a
+	// power of 2. alignments below a page are served by the size
+	// classes whose blocks are all aligned to it, without wasting
+	// more than the padding. larger ones take whole pages.
+	// realloc does not keep the alignment.
+	void *alloc_aligned(siz size, siz align);
 	void  free(void *mem);
+	// zeroed allocations. memory which comes from freshly mapped
+	// pages is already zero, so only recycled memory is cleared.
+	void *calloc(siz count, siz size);
+	void *calloc_a(siz size);
+	// dispatches a zeroed allocation to the tiers. it does not
+	// acquire heapLock.
+	void *callocUnlocked(siz size);
+	// tunes how many empty buckets are kept mapped. low must not
+	// be greater than high.
+	void setBucketRetention(siz perClass, siz low, siz high);
+	// releases all the empty buckets and spans back to the os, and
+	// unmaps the pages inside the free headers
+	void trim();
+	// resizes the allocation at mem to 'size' bytes, returning its
+	// new address. a block stays where it is when the new size still
+	// belongs to its size class, or when a large block can grow into
+	// the free header next to it, or shrink by splitting off its tail.
+	// otherwise, the contents are copied to a new allocation.
+	void *realloc(void *mem, siz size);
+	// returns the number of bytes usable at mem
+	siz usableSize(void *mem);
+	// tries to resize the allocation at mem without moving it.
+	// it does not acquire heapLock, that is upto the caller.
+	bool resizeInPlace(void *mem, siz size);
+	// returns true if mem lies in the range of this heap
+	bool owns(void *mem) const {
+		return ready && (uptr)mem >= heapStart && (uptr)mem < heapEnd;
+	}
+	// frees a block of this heap from a task which does not own the
+	// heap, without acquiring heapLock. the block is pushed to a
+	// lock free list, and is actually freed by the next allocation,
+	// so a consumer can release the buffers handed to it by a
+	// producer without contending with it.
+	void freeRemote(void *mem);
+	// blocks freed remotely, linked through their first word
+	void *volatile remoteFrees;
+	void drainRemoteFrees();
+	// same as above, but the smaller size classes are served from
+	// the given magazine cache, without acquiring heapLock when
+	// possible.
+	void *alloc(siz size, MagazineCache &cache);
+	void  free(void *mem, MagazineCache &cache);
+	// releases all the blocks cached in the magazines back to the
+	// buckets. must be called before the cache goes out of use.
+	void drain(MagazineCache &cache);
+
+	// tagged allocations, to account the memory of the kernel to
+	// its subsystems. a tagged allocation takes whole pages of the
+	// huge region, or a header of its own if there is no run left,
+	// and its tag is kept in the tag of the run or in the header, so
+	// the blocks of the size classes don't grow for it. the small
+	// objects of a subsystem come from an ObjectCache, whose slabs
+	// carry the tag. the memory is page aligned, and zeroed if asked.
+	void *allocTagged(siz size, MemTag tag, bool zero = false);
+	void *allocTaggedUnlocked(siz size, MemTag tag, bool zero);
+	// returns the tag of an allocation, MemTag::None if it has none.
+	// it does not acquire heapLock.
+	MemTag tagOf(void *mem);
+
+	// statistics, which are always kept. the sizes of the blocks are
+	// counted, not the sizes asked for, and the blocks cached in the
+	// magazines count as allocated.
+	struct Counter {
+		u32 allocs;
+		u32 frees;
+		Counter() : allocs(0), frees(0) {
+		}
+	};
+	Counter smallCounters[BlockCount];
+	Counter mediumCounters[MediumClassCount];
+	Counter largeCounter;
+	Counter hugeCounter;
+	siz     bytesInUse;
+	siz     peakBytesInUse;
+	siz     bucketsInUse;
+	siz     peakBucketsInUse;
+	siz     spansInUse;
+	siz     peakSpansInUse;
+
+	void countAlloc(Counter &c, siz bytes) {
+		c.allocs++;
+		if((bytesInUse += bytes) > peakBytesInUse)
+			peakBytesInUse = bytesInUse;
+	}
+	void countFree(Counter &c, siz bytes) {
+		c.frees++;
+		bytesInUse -= bytes;
+	}
+	void countResize(siz oldBytes, siz newBytes) {
+		bytesInUse += newBytes - oldBytes;
+		if(bytesInUse > peakBytesInUse)
+			peakBytesInUse = bytesInUse;
+	}
+
+	// exact counters of the tagged allocations, one for each tag.
+	// the one of MemTag::None is never used.
+	struct TagCounter {
+		u32 allocs;
+		u32 frees;
+		siz bytesInUse;
+		siz peakBytesInUse;
+		TagCounter() : allocs(0), frees(0), bytesInUse(0), peakBytesInUse(0) {
+		}
+	};
+	TagCounter tagCounters[(siz)MemTag::Count];
+
+	void countTagAlloc(MemTag tag, siz bytes) {
+		TagCounter &c = tagCounters[(siz)tag];
+		c.allocs++;
+		countTagGrow(tag, bytes);
+	}
+	void countTagGrow(MemTag tag, siz bytes) {
+		TagCounter &c = tagCounters[(siz)tag];
+		if((c.bytesInUse += bytes) > c.peakBytesInUse)
+			c.peakBytesInUse = c.bytesInUse;
+	}
+	void countTagFree(MemTag tag, siz bytes) {
+		TagCounter &c = tagCounters[(siz)tag];
+		c.frees++;
+		c.bytesInUse -= bytes;
+	}
+
+	// a snapshot of the state of the heap
+	struct Stats {
+		siz bytesInUse;
+		siz peakBytesInUse;
+		siz bucketsInUse;
+		siz peakBucketsInUse;
+		siz numBuckets;
+		siz emptyBuckets; // retained by the size classes
+		siz spansInUse;
+		siz peakSpansInUse;
+		siz numSpans;
+		// the free headers of the large region
+		siz freeHeaders;
+		siz largeFreeBytes;
+		siz largestFreeBlock;
+		// the free runs of the huge region
+		siz hugeFreePages;
+		siz largestHugeRun; // in pages
+		siz numHugePages;
+		// external fragmentation of the large and the huge regions,
+		// in parts per thousand. it is the part of the free memory
+		// which is not in the largest free block, i.e. which can't
+		// serve an allocation of the size of all of it.
+		u32 largeFragmentation;
+		u32 hugeFragmentation;
+
+		u32 dump() const;
+	};
+	Stats stats();
+	// the counters of the classes, taken at once, so that they can
+	// be printed after the heap is let go of. it is too large for
+	// the stack of a task.
+	struct ClassStats {
+		struct Class {
+			siz holders; // buckets or spans
+			siz empty;
+			u32 allocs;
+			u32 frees;
+		};
+		Class small[BlockCount];
+		Class medium[MediumClassCount];
+		Class large;
+		Class huge;
+
+		// prints the classes which have been used
+		u32 dump() const;
+	};
+	void classStats(ClassStats &cs);
+	// prints the counters of the tags which have been used
+	u32 dumpTags();
 
 	// base contains the base address of start of the heap
 	// size contains the total size of the heap. the heap will
 	// not allocate all the pages upfront, it will just reserve
 	// them.
 	void init(siz base, siz size, Paging::Directory *dir);
+	// same as above, but only records the range. the structures of
+	// the heap are set up on its first allocation, so a task which
+	// never allocates does not pay for them.
+	void reserve(siz base, siz size, Paging::Directory *dir);
+
+	// set once the structures are in place
+	bool ready;
+	// called with heapLock held before every allocation. it sets up
+	// the heap if needed, and takes back the blocks freed remotely.
+	void prepareAlloc() {
+		if(!ready)
+			setup();
+		if(remoteFrees)
+			drainRemoteFrees();
+	}
+	// the structures take at most MetaPerScale bytes for every
+	// ScalePages pages of usable memory, that is the pages of at
+	// most one span, and of a bucket and a huge tag per BucketRatio
+	// and HugeRatio pages
+	static const siz ScalePages = MediumRatio * SpanSize / Paging::PageSize;
+	static const siz MetaPerScale =
+	    ScalePages * Paging::PageSize / BucketRatio / BucketSize *
+	        sizeof(Bucket) +
+	    sizeof(Span) + ScalePages / HugeRatio * sizeof(u32);
+	// sizes the regions and maps the pages for the structures.
+	// it does not acquire heapLock, that is upto the caller.
+	void setup();
 };
@@ -0,0 +1,106 @@
+#include <drivers/terminal.h>
+#include <mem/heapprofiler.h>
+#include <sched/scopedlock.h>
+#include <sys/stacktrace.h>
+
+bool                 HeapProfiler::Enabled   = false;
+siz                  HeapProfiler::Interval  = 0;
+siz                  HeapProfiler::Countdown = 0;
+u32                  HeapProfiler::Taken     = 0;
+SpinLock             HeapProfiler::Lock      = SpinLock();
+SpinLock             HeapProfiler::DumpLock  = SpinLock();
+HeapProfiler::Sample HeapProfiler::Ring[RingSize];
+HeapProfiler::Site   HeapProfiler::Sites[RingSize];
+
+bool HeapProfiler::Sample::sameStack(const Sample &s) const {
+	if(frameCount != s.frameCount)
+		return false;
+	for(u32 i = 0; i < frameCount; i++)
+		if(frames[i] != s.frames[i])
+			return false;
+	return true;
+}
+
+void HeapProfiler::start(siz interval) {
+	ScopedLock sl(Lock);
+	// stopping keeps the samples around to be dumped
+	Enabled = interval > 0;
+	if(!Enabled)
+		return;
+	Interval  = interval;
+	Countdown = interval;
+	Taken     = 0;
+}
+
+void HeapProfiler::stop() {
+	ScopedLock sl(Lock);
+	Enabled = false;
+}
+
+void HeapProfiler::sample(siz bytes) {
+	ScopedLock sl(Lock);
+	// the profiler may have been stopped while we waited
+	if(!Enabled)
+		return;
+	if(bytes < Countdown) {
+		Countdown -= bytes;
+		return;
+	}
+	// a large allocation may cross more than one mark, but it is
+	// still recorded only once
+	Countdown = Interval - (bytes - Countdown) % Interval;
+	Sample &s = Ring[Taken++ % RingSize];
+	s.bytes   = bytes;
+	// skip the frames of sample() and of the heap function which
+	// called it, so the first one belongs to the allocating code
+	s.frameCount = Stacktrace::capture(s.frames, MaxFrames, 2);
+}
+
+void HeapProfiler::dump(u32 limit) {
+	ScopedLock dl(DumpLock);
+	// aggregate the ring under the lock, so that the samples are not
+	// overwritten while we read them, and print without it
+	Lock.lock();
+	u32 taken     = Taken;
+	siz interval  = Interval;
+	u32 sample    = taken < RingSize ? taken : RingSize;
+	u32 siteCount = 0;
+	for(u32 i = 0; i < sample; i++) {
+		u32 j = 0;
+		while(j < siteCount && !Sites[j].stack.sameStack(Ring[i])) j++;
+		if(j == siteCount) {
+			Sites[j].stack   = Ring[i];
+			Sites[j].samples = 0;
+			Sites[j].bytes   = 0;
+			siteCount++;
+		}
+		Sites[j].samples++;
+		Sites[j].bytes += Ring[i].bytes;
+	}
+	Lock.unlock();
+
+	Terminal::write(Terminal::Mode::Dec, "Heap profile: ", taken,
+	                " samples, one every ", interval, " bytes, ", siteCount,
+	                " call stacks in the last ", sample, "\n");
+	if(limit == 0 || limit > siteCount)
+		limit = siteCount;
+	// selection sort is fine for a ring this small, and we only need
+	// to sort as many sites as we print
+	for(u32 i = 0; i < limit; i++) {
+		u32 max = i;
+		for(u32 j = i + 1; j < siteCount; j++)
+			if(Sites[j].bytes > Sites[max].bytes)
+				max = j;
+		Site s     = Sites[max];
+		Sites[max] = Sites[i];
+		Sites[i]   = s;
+
+		Terminal::write(Terminal::Mode::Dec, "#", i + 1, ": ", s.samples,
+		                " samples, ", s.bytes, " bytes\n");
+		for(u32 f = 0; f < s.stack.frameCount; f++) {
+			Terminal::write("\tat ");
+			Stacktrace::printSymbol(s.stack.frames[f]);
+			Terminal::write("\n");
+		}
+	}
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <sched/spinlock.h>
+#include <sys/myos.h>
+
+// a sampling profiler for the allocations on all the heaps, to find
+// out who allocates the most. each time another 'interval' bytes are
+// allocated, the allocation crossing the mark is recorded, along with
+// the return addresses of its callers, in a fixed ring which overwrites
+// the oldest samples once it is full. an interval of 1 samples every
+// allocation.
+//
+// the allocation paths only test Enabled before calling sample(), so
+// there is nothing else to pay while the profiler is off.
+struct HeapProfiler {
+	// number of return addresses recorded per sample
+	static const u32 MaxFrames = 8;
+	static const u32 RingSize  = 256;
+
+	struct Sample {
+		siz  bytes;
+		u32  frameCount;
+		uptr frames[MaxFrames];
+
+		bool sameStack(const Sample &s) const;
+	};
+
+	// a call stack, with the totals of all the samples taken on it
+	struct Site {
+		Sample stack;
+		u32    samples;
+		u64    bytes;
+	};
+
+	static bool     Enabled;
+	static siz      Interval;
+	static siz      Countdown; // bytes until the next sample
+	static u32      Taken;     // samples taken since the last start
+	static Sample   Ring[RingSize];
+	static SpinLock Lock;
+
+	// aggregated by dump(), which holds DumpLock while it uses them
+	static Site     Sites[RingSize];
+	static SpinLock DumpLock;
+
+	// starts sampling every 'interval' bytes, dropping the samples
+	// taken so far. an interval of 0 stops the profiler, keeping the
+	// samples.
+	static void start(siz interval);
+	static void stop();
+	// called by the heap for each allocation while Enabled is set.
+	// it must not be inlined, so that the frames it skips are always
+	// the same.
+	static void sample(siz bytes) __attribute__((noinline));
+	// writes the 'limit' call stacks which allocated the most bytes
+	// in the samples of the ring, or all of them if limit is 0
+	static void dump(u32 limit = 0);
+};
@@ -0,0 +1,102 @@
+#include <arch/x86/asm.h>
+#include <drivers/serial.h>
+#include <drivers/terminal.h>
+#include <mem/heap.h>
+#include <mem/heaptrace.h>
+#include <sched/scheduler.h>
+#include <sched/scopedlock.h>
+#include <sys/string.h>
+
+#ifdef HEAP_TRACE
+
+bool              HeapTrace::Recording = true;
+u32               HeapTrace::Recorded  = 0;
+SpinLock          HeapTrace::Lock      = SpinLock();
+HeapTrace::Record HeapTrace::Ring[RingSize];
+
+void HeapTrace::record(Op op, const Heap *heap, void *mem, siz size,
+                       uptr extra) {
+	ScopedLock sl(Lock);
+	if(!Recording)
+		return;
+	Record &r = Ring[Recorded++ % RingSize];
+	r.tsc     = Asm::rdtsc();
+	r.address = (uptr)mem;
+	r.size    = size;
+	r.extra   = extra;
+	r.task    = Scheduler::CurrentTask ? Scheduler::CurrentTask->id : 0;
+	r.op      = op;
+	r.flags   = heap == Memory::kernelHeap ? KernelHeap : 0;
+}
+
+void HeapTrace::start() {
+	ScopedLock sl(Lock);
+	Recording = true;
+	Recorded  = 0;
+}
+
+void HeapTrace::stop() {
+	ScopedLock sl(Lock);
+	Recording = false;
+}
+
+static void streamBytes(const void *data, siz bytes) {
+	const u8 *b = (const u8 *)data;
+	for(siz i = 0; i < bytes; i++) Serial::write(b[i], Serial::Com::Port2);
+}
+
+void HeapTrace::stream() {
+	static bool portReady = false;
+	if(!portReady) {
+		Serial::init(Serial::Com::Port2);
+		portReady = true;
+	}
+	// pause the recording while the ring is written, instead of
+	// holding the lock for as long as the port takes, and resume
+	// it afterwards if it was on
+	Lock.lock();
+	bool recording = Recording;
+	Recording      = false;
+	Lock.unlock();
+
+	u32          count = Recorded < RingSize ? Recorded : RingSize;
+	StreamHeader h;
+	memcpy(h.magic, "HTRC", sizeof(h.magic));
+	h.version       = Version;
+	h.recordSize    = sizeof(Record);
+	h.count         = count;
+	h.dropped       = Recorded - count;
+	h.tscTicksPerMs = Scheduler::TscTicksPerMs;
+	streamBytes(&h, sizeof(h));
+	for(u32 i = Recorded - count; i != Recorded; i++)
+		streamBytes(&Ring[i % RingSize], sizeof(Record));
+
+	Lock.lock();
+	Recording = recording;
+	Lock.unlock();
+	Terminal::write(Terminal::Mode::Dec, "Streamed ", count,
+	                " heap operations, ", h.dropped, " were dropped\n");
+}
+
+#else
+
+// the shell commands are always there, so that they tell how to
+// enable the trace instead of being unknown
+static void notCompiled() {
+	Terminal::err("The heap trace is not compiled in, build with "
+	              "HEAP_TRACE=1!");
+}
+
+void HeapTrace::start() {
+	notCompiled();
+}
+
+void HeapTrace::stop() {
+	notCompiled();
+}
+
+void HeapTrace::stream() {
+	notCompiled();
+}
+
+#endif
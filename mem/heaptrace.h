@@ -0,0 +1,83 @@
+#pragma once
+
+#include <sched/spinlock.h>
+#include <sys/myos.h>
+
+struct Heap;
+
+// records the allocations and the frees of all the heaps in a ring,
+// so that they can be streamed to the host and replayed on the heap
+// there (see tools/heaptrace.py and tools/heaphost). it is only
+// compiled in when the kernel is built with HEAP_TRACE=1. otherwise
+// record() is empty, and the heap does not pay anything for it.
+//
+// the ring keeps the last RingSize operations. the heap records an
+// operation before it releases heapLock, so the records of a heap
+// are in the order the heap saw them.
+struct HeapTrace {
+#ifdef HEAP_TRACE
+	static const bool Available = true;
+#else
+	static const bool Available = false;
+#endif
+
+	// the operations are the letters of the replay format of heaphost
+	enum Op : u8 {
+		Alloc        = 'a',
+		AllocAligned = 'A',
+		Calloc       = 'c',
+		Realloc      = 'r',
+		Free         = 'f'
+	};
+	// set in Record::flags when the operation is on the kernel heap,
+	// otherwise it is on the heap of the task
+	static const u8 KernelHeap = 1;
+
+	// the layout is read by tools/heaptrace.py, so it must not change
+	// without bumping Version
+	struct Record {
+		u64 tsc;     // when the operation was done
+		u32 address; // returned by an alloc, or given to a free
+		u32 size;    // asked for, 0 for a free
+		u32 extra;   // the alignment, or the old address of a realloc
+		u16 task;    // id of the task which did it
+		u8  op;
+		u8  flags;
+	};
+	static_assert(sizeof(Record) == 24, "Record must be packed!");
+
+	// written before the records when the ring is streamed
+	struct StreamHeader {
+		char magic[4]; // HTRC
+		u16  version;
+		u16  recordSize;
+		u32  count;   // number of records which follow
+		u32  dropped; // overwritten before the stream
+		u64  tscTicksPerMs;
+	};
+	static const u16 Version = 1;
+
+#ifdef HEAP_TRACE
+	static const u32 RingSize = 8192;
+
+	static bool     Recording;
+	static u32      Recorded; // since the last start
+	static Record   Ring[RingSize];
+	static SpinLock Lock;
+
+	static void record(Op op, const Heap *heap, void *mem, siz size = 0,
+	                   uptr extra = 0);
+#else
+	static void record(Op, const Heap *, void *, siz = 0, uptr = 0) {
+	}
+#endif
+
+	// starts recording, dropping the operations recorded so far, or
+	// stops it, keeping them. the kernel starts recording at boot.
+	static void start();
+	static void stop();
+	// writes the records in the ring, oldest first, to the second
+	// serial port, so that they are not mixed with the output of the
+	// terminal on the first one
+	static void stream();
+};
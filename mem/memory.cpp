@@ -1,4 +1,5 @@
 #include <arch/x86/kernel_layout.h>
+#include <drivers/terminal.h>
 #include <mem/heap.h>
 #include <mem/memory.h>
 #include <mem/paging.h>
@@ -10,6 +11,9 @@ uptr       Memory::placementAddress = (uptr)&__ld_kernel_end;
 Heap      *Memory::kernelHeap       = NULL;
 siz        Memory::Size             = 0;
 
+const char *Memory::TagNames[(siz)MemTag::Count] = {"none", "scheduler",
+                                                    "paging", "terminal"};
+
 // we need to do the pointless & and * because CurrentTask is
 // volatile, but the heap functions are not. that is fine,
 // because this function will only run in the context
@@ -18,8 +22,13 @@ void *Memory::alloc(siz size) {
 	return ((Heap *)(&Scheduler::CurrentTask->heap))->alloc(size);
 }
 
+// until the scheduler is up, there is no task to own a magazine
+// cache, so the kernel heap is used directly.
 void *Memory::kalloc(siz size) {
-	return kernelHeap->alloc(size);
+	if(!Scheduler::CurrentTask)
+		return kernelHeap->alloc(size);
+	return kernelHeap->alloc(
+	    size, ((Task *)Scheduler::CurrentTask)->kernelCache);
 }
 
 void *Memory::kalloc_noheap(siz size) {
@@ -34,17 +43,110 @@ void *Memory::kalloc_a(siz size) {
 	return kernelHeap->alloc_a(size);
 }
 
+void *Memory::alloc_aligned(siz size, siz align) {
+	return ((Heap *)(&Scheduler::CurrentTask->heap))
+	    ->alloc_aligned(size, align);
+}
+
+void *Memory::kalloc_aligned(siz size, siz align) {
+	return kernelHeap->alloc_aligned(size, align);
+}
+
+void *Memory::kalloc(siz size, MemTag tag) {
+	return kernelHeap->allocTagged(size, tag);
+}
+
+void *Memory::kalloc_a(siz size, MemTag tag) {
+	return kernelHeap->allocTagged(size, tag);
+}
+
+void *Memory::kzalloc_a(siz size, MemTag tag) {
+	return kernelHeap->allocTagged(size, tag, true);
+}
+
 void *Memory::kalloc_anoheap(siz size) {
 	Paging::alignIfNeeded(placementAddress);
 	return kalloc_noheap(size);
 }
 
+void *Memory::calloc(siz count, siz size) {
+	return ((Heap *)(&Scheduler::CurrentTask->heap))->calloc(count, size);
+}
+
+void *Memory::kzalloc(siz size) {
+	return kernelHeap->calloc(1, size);
+}
+
+void *Memory::kzalloc_a(siz size) {
+	return kernelHeap->calloc_a(size);
+}
+
+void *Memory::realloc(void *addr, siz size) {
+	Heap *heap = (Heap *)(&Scheduler::CurrentTask->heap);
+	if(addr && !heap->owns(addr) && kernelHeap->owns(addr))
+		return kernelHeap->realloc(addr, size);
+	return heap->realloc(addr, size);
+}
+
+void *Memory::krealloc(void *addr, siz size) {
+	return kernelHeap->realloc(addr, size);
+}
+
 void Memory::kfree(void *addr) {
-	kernelHeap->free(addr);
+	if(!Scheduler::CurrentTask) {
+		kernelHeap->free(addr);
+		return;
+	}
+	Heap *heap = (Heap *)(&Scheduler::CurrentTask->heap);
+	if(addr && !kernelHeap->owns(addr) && heap->owns(addr)) {
+		heap->free(addr);
+		return;
+	}
+	kernelHeap->free(addr, ((Task *)Scheduler::CurrentTask)->kernelCache);
 }
 
+// the heap of a task is only mapped in the task itself, so a block
+// which is not ours must come from the kernel heap, handed to us by
+// some other task. it is queued to be freed by the next allocation
+// on the kernel heap, so the hand-off does not contend for its lock.
 void Memory::free(void *addr) {
-	((Heap *)(&Scheduler::CurrentTask->heap))->free(addr);
+	Heap *heap = (Heap *)(&Scheduler::CurrentTask->heap);
+	if(!addr || heap->owns(addr)) {
+		heap->free(addr);
+	} else if(kernelHeap->owns(addr)) {
+		kernelHeap->freeRemote(addr);
+	} else {
+		Terminal::err("Freeing memory not owned by any heap: ",
+		              Terminal::Mode::HexOnce, (uptr)addr, "\n");
+		for(;;)
+			;
+	}
+}
+
+siz Memory::alloc_bulk(siz size, siz count, void **out) {
+	return ((Heap *)(&Scheduler::CurrentTask->heap))
+	    ->allocBulk(size, count, out);
+}
+
+void Memory::free_bulk(void **addrs, siz count) {
+	((Heap *)(&Scheduler::CurrentTask->heap))->freeBulk(addrs, count);
+}
+
+// a batch goes to the kernel heap directly, past the magazines
+// of the task
+siz Memory::kalloc_bulk(siz size, siz count, void **out) {
+	return kernelHeap->allocBulk(size, count, out);
+}
+
+void Memory::kfree_bulk(void **addrs, siz count) {
+	kernelHeap->freeBulk(addrs, count);
+}
+
+void Memory::prefault(void *addr, siz size) {
+	if(kernelHeap->owns(addr))
+		kernelHeap->prefault(addr, size);
+	else
+		((Heap *)(&Scheduler::CurrentTask->heap))->prefault(addr, size);
 }
 
 extern "C" {
@@ -52,6 +154,14 @@ void *malloc(size_t size) {
 	return Memory::alloc(size);
 }
 
+void *calloc(size_t count, size_t size) {
+	return Memory::calloc(count, size);
+}
+
+void *realloc(void *addr, size_t size) {
+	return Memory::realloc(addr, size);
+}
+
 void free(void *addr) {
 	Memory::free(addr);
 }
@@ -2,6 +2,10 @@
 
 #include <sys/myos.h>
 
+// the subsystems which the memory of the kernel is accounted to,
+// by the tagged allocation functions below
+enum class MemTag : u8 { None, Scheduler, Paging, Terminal, Count };
+
 struct Heap;
 struct Memory {
 
@@ -20,10 +24,44 @@ struct Memory {
 	static void *kalloc_a(siz size); // allocates from the kernel heap
 	static void *
 	    kalloc_anoheap(siz size); // allocating until the heap is active
+	// aligned to any power of 2
+	static void *alloc_aligned(siz size, siz align);  // from task heap
+	static void *kalloc_aligned(siz size, siz align); // from kernel heap
+
+	// tagged allocs from the kernel heap. they always take whole
+	// pages, and are always page aligned. a tagged block is freed by
+	// kfree like any other, which accounts it back to its tag.
+	static void *kalloc(siz size, MemTag tag);
+	static void *kalloc_a(siz size, MemTag tag);
+	static void *kzalloc_a(siz size, MemTag tag);
+	static const char *TagNames[(siz)MemTag::Count];
+
+	// zeroed alloc. memory which is freshly mapped is already
+	// zero, so only recycled memory is cleared.
+	static void *calloc(siz count, siz size); // allocates from task heap
+	static void *kzalloc(siz size);   // allocates from the kernel heap
+	static void *kzalloc_a(siz size); // aligned, from the kernel heap
+
+	// resizes an allocation, moving it only if it can't grow in place
+	static void *realloc(void *addr, siz size);  // resizes alloc'd memory
+	static void *krealloc(void *addr, siz size); // resizes kalloc'd memory
 
 	static void free(void *addr);  // only works when heap is active
 	static void kfree(void *addr); // frees kalloc'd memory
 
+	// allocates or frees a batch of blocks of the same size, taking
+	// the lock of the heap once. alloc_bulk returns the number of
+	// blocks it could allocate, in the order of their addresses.
+	static siz  alloc_bulk(siz size, siz count, void **out); // task heap
+	static void free_bulk(void **addrs, siz count);
+	static siz  kalloc_bulk(siz size, siz count, void **out); // kernel
+	static void kfree_bulk(void **addrs, siz count);
+
+	// large allocations only reserve their pages, which are mapped
+	// as they are touched. this maps all of them right away, for the
+	// callers which are going to write the whole allocation.
+	static void prefault(void *addr, siz size);
+
 	template <typename T, typename... F> static T *create(F... args) {
 		T *val = (T *)alloc(sizeof(T));
 		(*val) = T(args...);
@@ -0,0 +1,180 @@
+#include <drivers/terminal.h>
+#include <mem/memory.h>
+#include <mem/objectcache.h>
+#include <mem/paging.h>
+#include <sched/scopedlock.h>
+#include <sys/string.h>
+
+ObjectCache *ObjectCache::Caches     = NULL;
+SpinLock     ObjectCache::CachesLock = SpinLock();
+
+void ObjectCache::init(const char *n, siz size, siz align, Constructor c,
+                       Destructor d, MemTag t, bool e) {
+	setup(n, size, align, c, d, t, e);
+	ScopedLock sl(CachesLock);
+	nextCache = Caches;
+	Caches    = this;
+}
+
+void ObjectCache::ensureInit(const char *n, siz size, siz align,
+                             Constructor c, Destructor d, MemTag t) {
+	if(isReady())
+		return;
+	ScopedLock sl(CachesLock);
+	if(isReady())
+		return;
+	setup(n, size, align, c, d, t, false);
+	nextCache = Caches;
+	Caches    = this;
+}
+
+void ObjectCache::setup(const char *n, siz size, siz align, Constructor c,
+                        Destructor d, MemTag t, bool e) {
+	if(size == 0 || align == 0 || (align & (align - 1)) ||
+	   align > Paging::PageSize) {
+		Terminal::err("Invalid object cache layout for ", n, "!\n");
+		for(;;)
+			;
+	}
+	name  = n;
+	ctor  = c;
+	dtor  = d;
+	tag   = t;
+	eager = e;
+	// a free object keeps the link to the next one in its first word,
+	// unless it has a constructed state to keep, in which case the
+	// link goes right after it
+	siz linked = size < sizeof(void *) ? sizeof(void *) : size;
+	freeOffset = 0;
+	if(ctor) {
+		freeOffset = (size + sizeof(void *) - 1) & -sizeof(void *);
+		linked     = freeOffset + sizeof(void *);
+	}
+	stride = (linked + align - 1) & -align;
+	// pick the smallest slab which wastes at most an eighth of itself
+	for(siz pages = 1; pages <= MaxSlabPages; pages++) {
+		slabSize       = pages * Paging::PageSize;
+		objectsPerSlab = (slabSize - sizeof(Slab)) / stride;
+		if(objectsPerSlab &&
+		   (slabSize - objectsPerSlab * stride) * 8 <= slabSize)
+			break;
+	}
+	if(objectsPerSlab == 0) {
+		Terminal::err("Objects of ", n, " are too large to be cached!\n");
+		for(;;)
+			;
+	}
+	lock      = SpinLock();
+	freeList  = NULL;
+	carveNext = carveEnd = 0;
+	slabs                = NULL;
+	allocs = frees = inUse = peakInUse = numSlabs = 0;
+	// the size is set at last, as it marks the cache ready
+	__sync_synchronize();
+	objectSize = size;
+}
+
+void *ObjectCache::carve() {
+	if(carveNext == carveEnd) {
+		// the slab comes zeroed, so objects which are never
+		// constructed are handed out zeroed by zalloc
+		uptr  start = (uptr)(tag == MemTag::None
+		                         ? Memory::kzalloc_a(slabSize)
+		                         : Memory::kzalloc_a(slabSize, tag));
+		if(eager)
+			Memory::prefault((void *)start, slabSize);
+		Slab *s     = (Slab *)(start + slabSize - sizeof(Slab));
+		s->next     = slabs;
+		slabs       = s;
+		carveNext   = start;
+		carveEnd    = start + objectsPerSlab * stride;
+		numSlabs++;
+	}
+	void *object = (void *)carveNext;
+	carveNext += stride;
+	if(ctor)
+		ctor(object);
+	return object;
+}
+
+void *ObjectCache::alloc() {
+	ScopedLock sl(lock);
+	void      *object;
+	if(freeList) {
+		object   = freeList;
+		freeList = *(void **)((uptr)object + freeOffset);
+	} else {
+		object = carve();
+	}
+	allocs++;
+	if(++inUse > peakInUse)
+		peakInUse = inUse;
+	return object;
+}
+
+void *ObjectCache::zalloc() {
+	ScopedLock sl(lock);
+	void      *object;
+	if(freeList) {
+		object   = freeList;
+		freeList = *(void **)((uptr)object + freeOffset);
+		memset(object, 0, objectSize);
+	} else {
+		// fresh from a zeroed slab
+		object = carve();
+	}
+	allocs++;
+	if(++inUse > peakInUse)
+		peakInUse = inUse;
+	return object;
+}
+
+void ObjectCache::free(void *object) {
+	if(!object)
+		return;
+	ScopedLock sl(lock);
+	*(void **)((uptr)object + freeOffset) = freeList;
+	freeList                              = object;
+	frees++;
+	inUse--;
+}
+
+void ObjectCache::destroy() {
+	ScopedLock sl(lock);
+	if(inUse) {
+		Terminal::err("Destroying cache ", name, " with ", inUse,
+		              " objects in use!\n");
+		for(;;)
+			;
+	}
+	while(slabs) {
+		Slab *s     = slabs;
+		uptr  start = (uptr)s + sizeof(Slab) - slabSize;
+		// only the newest slab, which comes first, may have objects
+		// which are not carved out, and so never constructed
+		uptr end = carveEnd ? carveNext : start + objectsPerSlab * stride;
+		if(dtor)
+			for(uptr o = start; o < end; o += stride) dtor((void *)o);
+		slabs    = s->next;
+		carveEnd = 0;
+		Memory::kfree((void *)start);
+	}
+	freeList  = NULL;
+	carveNext = carveEnd = 0;
+	numSlabs             = 0;
+}
+
+u32 ObjectCache::dump() const {
+	return Terminal::write(name, " ( size: ", objectSize, " per slab: ",
+	                       objectsPerSlab, " slabs: ", numSlabs,
+	                       " in use: ", inUse, " peak: ", peakInUse,
+	                       " allocs: ", allocs, " frees: ", frees, " )");
+}
+
+void ObjectCache::dumpAll() {
+	ScopedLock sl(CachesLock);
+	for(ObjectCache *c = Caches; c; c = c->nextCache) {
+		c->dump();
+		Terminal::write("\n");
+	}
+}
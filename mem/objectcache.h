@@ -0,0 +1,94 @@
+#pragma once
+
+#include <mem/memory.h>
+#include <sched/spinlock.h>
+#include <sys/myos.h>
+
+// a cache of objects of a single type, in the style of a slab allocator.
+// objects are carved out of slabs of whole pages taken from the kernel
+// heap, and a freed object goes back to the free list of its cache, so
+// allocating one never goes through the size classes of the heap.
+//
+// the constructor, if any, runs only when an object is carved out of a
+// slab. a freed object keeps the state it was left in, so the next one
+// to allocate it gets back an already constructed object. the
+// destructor runs when the slabs are released by destroy().
+struct ObjectCache {
+	typedef void (*Constructor)(void *object);
+	typedef void (*Destructor)(void *object);
+
+	// a slab is a run of pages, with this at its very end
+	struct Slab {
+		Slab *next;
+	};
+
+	// a slab grows upto this many pages to keep the waste low
+	static const siz MaxSlabPages = 8;
+
+	const char *name;
+	siz         objectSize;
+	siz         stride;     // distance between two objects in a slab
+	siz         freeOffset; // where a free object keeps its link
+	siz         slabSize;
+	siz         objectsPerSlab;
+	Constructor ctor;
+	Destructor  dtor;
+	MemTag      tag;   // the slabs are accounted to this
+	bool        eager; // the slabs are mapped as soon as they are taken
+
+	SpinLock lock;
+	void    *freeList;
+	// objects of the newest slab which are not carved out yet
+	uptr  carveNext;
+	uptr  carveEnd;
+	Slab *slabs;
+
+	// statistics
+	u32 allocs;
+	u32 frees;
+	u32 inUse;
+	u32 peakInUse;
+	u32 numSlabs;
+
+	// all the caches which are set up, for reporting
+	ObjectCache        *nextCache;
+	static ObjectCache *Caches;
+	static SpinLock     CachesLock;
+
+	// sets up the cache for objects of 'size' bytes, aligned to 'align',
+	// which must be a power of 2 not larger than a page. the slabs
+	// are allocated with the given tag, if any. the pages of a slab
+	// are otherwise mapped as its objects are touched, so a cache
+	// whose objects are handed to the hardware by their physical
+	// address must be eager.
+	void init(const char *name, siz size, siz align, Constructor c = NULL,
+	          Destructor d = NULL, MemTag t = MemTag::None,
+	          bool eager = false);
+	// a static cache is zero initialized, so it is not ready until
+	// init() is called on it. this sets it up on its first use, which
+	// lets caches of templated types skip an explicit init.
+	void ensureInit(const char *name, siz size, siz align,
+	                Constructor c = NULL, Destructor d = NULL,
+	                MemTag t = MemTag::None);
+	bool isReady() const {
+		return objectSize != 0;
+	}
+
+	void *alloc();
+	// allocates a zeroed object. only for caches without a constructor.
+	void *zalloc();
+	void  free(void *object);
+	// runs the destructor on all the objects and releases the slabs.
+	// all the objects must be freed before.
+	void destroy();
+
+	u32         dump() const;
+	static void dumpAll();
+
+	// computes the layout and resets the cache
+	void setup(const char *name, siz size, siz align, Constructor c,
+	           Destructor d, MemTag t, bool eager);
+	// carves out the next object of the newest slab, taking a new
+	// slab if needed. the caller must hold the lock.
+	void *carve();
+};
@@ -9,20 +9,43 @@
 #include <sys/stacktrace.h>
 #include <sys/string.h>
 
-u32               *Paging::Frame::frames               = NULL;
-siz                Paging::Frame::numberOfFrames       = 0;
-siz                Paging::Frame::numberOfSets         = 0;
-Paging::Directory *Paging::Directory::CurrentDirectory = NULL;
-Paging::Directory *Paging::Directory::KernelDirectory  = NULL;
+u32                  *Paging::Frame::frames               = NULL;
+siz                   Paging::Frame::numberOfFrames       = 0;
+siz                   Paging::Frame::numberOfSets         = 0;
+u32                  *Paging::Frame::summary              = NULL;
+siz                   Paging::Frame::numberOfSummaries    = 0;
+u32                  *Paging::Frame::topSummary           = NULL;
+siz                   Paging::Frame::numberOfTopSummaries = 0;
+uptr                  Paging::Frame::poolStart            = 0;
+siz                   Paging::Frame::poolFrames           = 0;
+u32                   Paging::Frame::poolOrder            = 0;
+Paging::Frame::Buddy *Paging::Frame::buddies              = NULL;
+u32                   Paging::Frame::freeOrders           = 0;
+u16                   Paging::Frame::freeBuddies[MaxOrder + 1];
+u16                  *Paging::Frame::sharers              = NULL;
+Paging::Directory    *Paging::Directory::CurrentDirectory = NULL;
+Paging::Directory    *Paging::Directory::KernelDirectory  = NULL;
+ObjectCache           Paging::Table::Cache                = ObjectCache();
+u32                   Paging::FaultAround                 = 4;
 
 void Paging::Frame::set(uptr addr) {
 	uptr frame = addr / Paging::PageSize;
-	frames[index(frame)] |= ((u32)1 << offset(frame));
+	siz  set   = index(frame);
+	frames[set] |= ((u32)1 << offset(frame));
+	// the set just filled up, so it leaves the summaries
+	if(frames[set] == Limits::U32Max) {
+		summary[index(set)] &= ~((u32)1 << offset(set));
+		if(summary[index(set)] == 0)
+			topSummary[index(index(set))] &= ~((u32)1 << offset(index(set)));
+	}
 }
 
 void Paging::Frame::clear(uptr addr) {
 	uptr frame = addr / Paging::PageSize;
-	frames[index(frame)] &= ~((u32)1 << offset(frame));
+	siz  set   = index(frame);
+	frames[set] &= ~((u32)1 << offset(frame));
+	summary[index(set)] |= ((u32)1 << offset(set));
+	topSummary[index(index(set))] |= ((u32)1 << offset(index(set)));
 }
 
 bool Paging::Frame::test(uptr addr) {
@@ -30,37 +53,264 @@ bool Paging::Frame::test(uptr addr) {
 	return frames[index(frame)] & ((u32)1 << offset(frame));
 }
 
-bool Paging::Frame::searchInRange(uptr fri, uptr toi, uptr &result) {
-	result            = 0;
-	const u32 allFull = Limits::U32Max;
-	for(uptr i = fri; i < toi; i++) {
-		if(frames[i] == allFull)
-			continue;
-		result = i * sizeof(siz) * 8;
-		if(frames[i] == 0)
-			return true;
-		u32 search = ~frames[i]; // we are assuming siz is 32 bit
-		result += Asm::bsf(search);
-		return true;
+bool Paging::Frame::findFreeSet(siz set, siz &result) {
+	siz s = index(set);
+	if(s >= numberOfSummaries)
+		return false;
+	u32 bits = summary[s] & (Limits::U32Max << offset(set));
+	if(bits == 0) {
+		// the rest of this word of the summary is full, so find the
+		// next one which is not from the top. it is at most a few
+		// words long, even for 4 GiB of memory.
+		siz t   = index(s + 1);
+		u32 top = t < numberOfTopSummaries
+		              ? topSummary[t] & (Limits::U32Max << offset(s + 1))
+		              : 0;
+		while(top == 0) {
+			if(++t >= numberOfTopSummaries)
+				return false;
+			top = topSummary[t];
+		}
+		s    = (t << 5) + Asm::bsf(top);
+		bits = summary[s];
+	}
+	result = (s << 5) + Asm::bsf(bits);
+	return true;
+}
+
+bool Paging::Frame::findFreeFrom(uptr frame, uptr &result) {
+	siz set = index(frame);
+	if(set >= numberOfSets)
+		return false;
+	u32 free = ~frames[set] & (Limits::U32Max << offset(frame));
+	if(free == 0) {
+		if(!findFreeSet(set + 1, set))
+			return false;
+		free = ~frames[set];
 	}
-	return false;
+	result = (set << 5) + Asm::bsf(free);
+	return true;
 }
 
 bool Paging::Frame::findFirstFreeFrame(uptr &result, uptr lastFrame) {
-	siz lastIndex = index(lastFrame);
-	if(searchInRange(lastIndex, numberOfSets, result)) {
+	if(findFreeFrom(lastFrame, result))
 		return true;
+	// if we already started searching from the beginning, we're done
+	if(lastFrame == 0)
+		return false;
+	// else, search from the beginning. the frames after lastFrame
+	// are known to be used, so what we find is before it.
+	return findFreeFrom(0, result);
+}
+
+bool Paging::Frame::alloc(uptr &frame, uptr lastFrame) {
+	PAUSEI();
+	bool found = findFirstFreeFrame(frame, lastFrame);
+	if(found)
+		set(frame * PageSize);
+	RESUMEI();
+	return found;
+}
+
+void Paging::Frame::free(uptr frame) {
+	PAUSEI();
+	clear(frame * PageSize);
+	RESUMEI();
+}
+
+void Paging::Frame::Cache::init() {
+	count = 0;
+	// touch all of the cache now, as the page fault handler takes
+	// its frames from here, and can't fault on it itself
+	memset(frames, 0, sizeof(frames));
+}
+
+// the interrupts are kept off for the whole of alloc and free, as
+// reclaimCaches may drain the cache of any task which is not running
+bool Paging::Frame::Cache::alloc(uptr &frame) {
+	PAUSEI();
+	if(count == 0) {
+		while(count < CacheBatch && findFirstFreeFrame(frames[count])) {
+			set(frames[count] * PageSize);
+			count++;
+		}
+	}
+	bool found = count > 0;
+	if(found)
+		frame = frames[--count];
+	RESUMEI();
+	return found;
+}
+
+void Paging::Frame::Cache::free(uptr frame) {
+	PAUSEI();
+	if(count == CacheSize) {
+		// the cache is full, so release the older half of it back
+		// to the bitmap, and keep the recently freed ones
+		for(siz i = 0; i < CacheBatch; i++) clear(frames[i] * PageSize);
+		for(siz i = CacheBatch; i < CacheSize; i++)
+			frames[i - CacheBatch] = frames[i];
+		count -= CacheBatch;
 	}
+	frames[count++] = frame;
+	RESUMEI();
+}
 
-	// if we already started searching from the beginning, we're done
-	if(lastIndex == 0)
+void Paging::Frame::Cache::drain() {
+	PAUSEI();
+	while(count > 0) clear(frames[--count] * PageSize);
+	RESUMEI();
+}
+
+bool Paging::Frame::reclaimCaches() {
+	bool reclaimed = false;
+	PAUSEI();
+	for(Task *t = Scheduler::AllTasks; t; t = t->nextInAll) {
+		reclaimed = reclaimed || t->frameCache.count > 0;
+		t->frameCache.drain();
+	}
+	RESUMEI();
+	return reclaimed;
+}
+
+bool Paging::Frame::share(uptr frame) {
+	PAUSEI();
+	bool shared = sharers[frame] != Limits::U16Max;
+	if(shared)
+		sharers[frame]++;
+	RESUMEI();
+	return shared;
+}
+
+bool Paging::Frame::unshare(uptr frame) {
+	PAUSEI();
+	bool others = sharers[frame] > 0;
+	if(others)
+		sharers[frame]--;
+	RESUMEI();
+	return others;
+}
+
+void Paging::Frame::pushBuddy(u16 b, u32 order) {
+	Buddy &bd = buddies[b];
+	bd.order  = order;
+	bd.free   = true;
+	bd.prev   = NoBuddy;
+	bd.next   = freeBuddies[order];
+	if(bd.next != NoBuddy)
+		buddies[bd.next].prev = b;
+	freeBuddies[order] = b;
+	freeOrders |= (u32)1 << order;
+}
+
+void Paging::Frame::unlinkBuddy(u16 b) {
+	Buddy &bd = buddies[b];
+	if(bd.prev != NoBuddy)
+		buddies[bd.prev].next = bd.next;
+	else
+		freeBuddies[bd.order] = bd.next;
+	if(bd.next != NoBuddy)
+		buddies[bd.next].prev = bd.prev;
+	if(freeBuddies[bd.order] == NoBuddy)
+		freeOrders &= ~((u32)1 << bd.order);
+	bd.free = false;
+}
+
+bool Paging::Frame::allocContiguous(u32 order, uptr &frame) {
+	if(order > poolOrder)
+		return false;
+	PAUSEI();
+	// the smallest run which is large enough
+	u32 orders = freeOrders & (Limits::U32Max << order);
+	if(orders == 0) {
+		RESUMEI();
 		return false;
+	}
+	u32 o = Asm::bsf(orders);
+	u16 b = freeBuddies[o];
+	unlinkBuddy(b);
+	// split it down to the order asked for, freeing the upper halves
+	while(o > order) {
+		o--;
+		pushBuddy(b + (1 << o), o);
+	}
+	buddies[b].order = order;
+	RESUMEI();
+	frame = poolStart + b;
+	return true;
+}
 
-	// else, search from the beginning
-	if(searchInRange(0, lastIndex, result)) {
-		return true;
+void Paging::Frame::freeContiguous(uptr frame, u32 order) {
+	u16 b = frame - poolStart;
+	if(!inPool(frame) || order > poolOrder || buddies[b].free ||
+	   buddies[b].order != order) {
+		Terminal::err("Invalid contiguous free: frame ",
+		              Terminal::Mode::HexOnce, frame, " order ", order, "\n");
+		for(;;)
+			;
+	}
+	PAUSEI();
+	// merge with the buddy as long as it is free as a whole
+	while(order < poolOrder) {
+		u16 buddy = b ^ (1 << order);
+		if(!buddies[buddy].free || buddies[buddy].order != order)
+			break;
+		unlinkBuddy(buddy);
+		b &= ~(1 << order);
+		order++;
+	}
+	pushBuddy(b, order);
+	RESUMEI();
+}
+
+void Paging::Frame::initPool(Multiboot *boot) {
+	for(u32 o = 0; o <= MaxOrder; o++) freeBuddies[o] = NoBuddy;
+	siz frames = Memory::Size / PageSize / PoolShare;
+	if(frames > MaxPoolFrames)
+		frames = MaxPoolFrames;
+	if(frames == 0)
+		return;
+	poolOrder = Asm::bsr(frames);
+	if(poolOrder > MaxOrder)
+		poolOrder = MaxOrder;
+	// the pool is made of runs of the largest order, so that each of
+	// them is aligned to its length
+	frames &= ~(((siz)1 << poolOrder) - 1);
+	// find the highest place in a usable region where it fits
+	u8   nummaps  = boot->mmap_length / sizeof(Multiboot::MemoryMap);
+	uptr mmap_ptr = (uptr)boot->mmap_addr;
+	bool found    = false;
+	uptr start    = 0;
+	for(u8 i = 0; i < nummaps; i++, mmap_ptr += sizeof(Multiboot::MemoryMap)) {
+		Multiboot::MemoryMap *m = (Multiboot::MemoryMap *)P2V(mmap_ptr);
+		if(m->type != Multiboot::MemoryMap::Type::Usable ||
+		   m->length < (1024 * 1024) || m->base_addr < 0x100000 ||
+		   m->base_addr >= (u64)numberOfFrames * PageSize)
+			continue;
+		u64 first = (m->base_addr + PageSize - 1) / PageSize;
+		u64 last  = (m->base_addr + m->length) / PageSize;
+		if(last > numberOfFrames)
+			last = numberOfFrames;
+		if(last < frames)
+			continue;
+		u64 s = (last - frames) & ~(((u64)1 << poolOrder) - 1);
+		if(s >= first && (!found || s > start)) {
+			start = s;
+			found = true;
+		}
 	}
-	return false;
+	if(!found)
+		return;
+	poolStart  = start;
+	poolFrames = frames;
+	buddies    = (Buddy *)Memory::kalloc_noheap(frames * sizeof(Buddy));
+	memset(buddies, 0, frames * sizeof(Buddy));
+	for(siz f = 0; f < frames; f++) set((poolStart + f) * PageSize);
+	for(siz f = 0; f < frames; f += (siz)1 << poolOrder)
+		pushBuddy(f, poolOrder);
+	Terminal::write("Contiguous pool: ", Terminal::Mode::HexOnce,
+	                poolStart * PageSize, " - ", Terminal::Mode::HexOnce,
+	                (poolStart + frames) * PageSize, "\n");
 }
 
 u32 Paging::Page::dump() const {
@@ -68,7 +318,7 @@ u32 Paging::Page::dump() const {
 	if(present) {
 		res += Terminal::write("present ");
 		res += Terminal::write("frame: ", inmem.frame, " ");
-		if(os_shared) {
+		if(inmem.os_shared) {
 			res += Terminal::write("shared ");
 		}
 	} else {
@@ -93,8 +343,18 @@ uptr Paging::Page::alloc(bool isKernel, bool isWritable, uptr lastFrame) {
 		// Terminal::write(" -> No alloc!\n");
 		return inmem.frame;
 	}
-	siz idx;
-	if(!Frame::findFirstFreeFrame(idx, lastFrame)) {
+	uptr  idx;
+	Task *t = (Task *)Scheduler::CurrentTask;
+	// the kernel memory is mapped at boot, before there is any task,
+	// in order from lastFrame
+	bool found = t && lastFrame == 0 ? t->frameCache.alloc(idx)
+	                                 : Frame::alloc(idx, lastFrame);
+	// the bitmap is out of frames, but the caches of the tasks may
+	// still hold some
+	if(!found && Frame::reclaimCaches())
+		found = Frame::alloc(idx, lastFrame);
+	if(!found && !Frame::allocContiguous(0, idx)) {
+		// the pool is only used once the bitmap is full
 		Scheduler::suspend();
 		Terminal::err("No free frames:\n");
 		Terminal::err("Task: ", (u64)Scheduler::CurrentTask->id);
@@ -103,8 +363,10 @@ uptr Paging::Page::alloc(bool isKernel, bool isWritable, uptr lastFrame) {
 		for(;;)
 			;
 	}
-	Frame::set(idx * Paging::PageSize);
-	present     = 1;
+	// the bit means something else to the processor once the
+	// page is present
+	outmem.os_avail = 0;
+	present         = 1;
 	rw          = isWritable;
 	user        = !isKernel;
 	inmem.frame = idx;
@@ -122,36 +384,64 @@ uptr Paging::Page::allocDMA(bool isKernel, bool isWritable, uptr physicalAddr) {
 }
 
 void Paging::Page::free() {
+	// a reserved page does not have a frame yet
+	outmem.os_avail = 0;
 	if(!inmem.frame)
 		return;
-	Frame::clear(inmem.frame * Paging::PageSize);
-	inmem.frame = 0;
-	present     = 0;
+	// a frame shared after a clone stays with the other pages,
+	// if any of them is left
+	if(!inmem.os_shared || !Frame::unshare(inmem.frame)) {
+		Task *t = (Task *)Scheduler::CurrentTask;
+		if(Frame::inPool(inmem.frame))
+			Frame::freeContiguous(inmem.frame, 0);
+		else if(t)
+			t->frameCache.free(inmem.frame);
+		else
+			Frame::free(inmem.frame);
+	}
+	inmem.os_shared = 0;
+	inmem.frame     = 0;
+	present         = 0;
 }
 
 void Paging::Frame::init(Multiboot *boot) {
-	// calculate total memory
+	// calculate total memory, and the end of the usable memory which
+	// we can address, which the bitmap has to cover, holes included
 	u8   nummaps  = boot->mmap_length / sizeof(Multiboot::MemoryMap);
 	uptr mmap_ptr = (uptr)boot->mmap_addr;
+	u64  end      = 0;
 	for(u8 i = 0; i < nummaps; i++, mmap_ptr += sizeof(Multiboot::MemoryMap)) {
 		Multiboot::MemoryMap *m = (Multiboot::MemoryMap *)P2V(mmap_ptr);
 		if(m->type == Multiboot::MemoryMap::Type::Usable &&
-		   m->length >= (1024 * 1024))
+		   m->length >= (1024 * 1024)) {
 			Memory::Size += m->length;
+			if(m->base_addr + m->length > end)
+				end = m->base_addr + m->length;
+		}
 	}
 	Terminal::write("Total memory: ", Terminal::Mode::HexOnce, Memory::Size,
 	                "\n");
-	numberOfFrames = Memory::Size / PageSize;
-	// each frame occupies 1 bit of memory, so we need
-	// numberOfFrames / 8 bytes of memory
-	frames = (u32 *)Memory::kalloc_noheap(numberOfFrames / 8);
+	if(end > (u64)Limits::U32Max + 1)
+		end = (u64)Limits::U32Max + 1;
+	numberOfFrames = end / PageSize;
+	// each frame occupies 1 bit of memory, in sets of 32
+	numberOfSets = (numberOfFrames + 31) / 32;
+	frames       = (u32 *)Memory::kalloc_noheap(numberOfSets * sizeof(u32));
 	// by default, mark all frames as used
-	memset(frames, 0xFF, numberOfFrames / 8);
-	numberOfSets = numberOfFrames / (8 * sizeof(frames[0]));
+	memset(frames, 0xFF, numberOfSets * sizeof(u32));
+	// and so no set has a free frame yet
+	numberOfSummaries    = (numberOfSets + 31) / 32;
+	numberOfTopSummaries = (numberOfSummaries + 31) / 32;
+	siz summaryBytes = numberOfSummaries * sizeof(u32);
+	siz topBytes     = numberOfTopSummaries * sizeof(u32);
+	summary          = (u32 *)Memory::kalloc_noheap(summaryBytes);
+	topSummary       = (u32 *)Memory::kalloc_noheap(topBytes);
+	memset(summary, 0, summaryBytes);
+	memset(topSummary, 0, topBytes);
 
 	// mark the low memory as unused for now, we will map all frames
 	// in this range later, as it contains various bootloader infos
-	for(siz i = 0; i < 1024 * 1024; i++) Frame::clear(i);
+	for(siz i = 0; i < 1024 * 1024; i += PageSize) Frame::clear(i);
 
 	// check which frames are available for allocation,
 	// and set them as free
@@ -167,11 +457,15 @@ void Paging::Frame::init(Multiboot *boot) {
 			// space, so we can use this
 			for(u64 j = m->base_addr, l = 0; l < m->length;
 			    l += Paging::PageSize) {
-				Frame::clear((j + l) & 0xFFFFFFFF);
+				// the memory above 4 GiB can't be mapped
+				if(j + l >= end)
+					break;
+				Frame::clear(j + l);
 				// Terminal::write(l, "\n");
 			}
 		}
 	}
+	initPool(boot);
 }
 
 void Paging::switchPageDirectory(Paging::Directory *dir) {
@@ -194,9 +488,8 @@ Paging::Page *Paging::getPage(uptr address, bool create,
 		return &dir->tables[table_idx]->pages[pageno];
 	} else if(create) {
 		dir->tables[table_idx] =
-		    (Paging::Table *)Memory::kalloc_a(sizeof(Paging::Table));
+		    (Paging::Table *)Paging::Table::Cache.zalloc();
 		uptr tmp = Paging::getPhysicalAddress((uptr)dir->tables[table_idx]);
-		memset(dir->tables[table_idx], 0, sizeof(Paging::Table));
 		dir->tablesPhysical[table_idx] = tmp | 0x7; // PRESENT, RW, US.
 		return &dir->tables[table_idx]->pages[pageno];
 	} else {
@@ -238,14 +531,17 @@ Paging::Page *Paging::getFreePage(Paging::Directory *dir, uptr &address,
 		// check for a free page
 		Table *t = dir->tables[i];
 		for(siz j = 0; j < Paging::PagesPerTable; j++) {
-			if(t->pages[j].inmem.frame ==
-			   0) { // it is free, so allocate and return
-				    // this. we actually need to alloc here
-				    // to mark it as used.
-				p       = &t->pages[j];
-				address = ((i * Paging::PagesPerTable) + j) * Paging::PageSize;
-				break;
-			}
+			uptr a = ((i * Paging::PagesPerTable) + j) * Paging::PageSize;
+			// the pages reserved by a heap, or in a region, are not free
+			if(t->pages[j].inmem.frame || t->pages[j].outmem.os_avail ||
+			   findRegion(a, dir) ||
+			   findRegion(a, Directory::KernelDirectory))
+				continue;
+			// it is free, so allocate and return this. we actually
+			// need to alloc here to mark it as used.
+			p       = &t->pages[j];
+			address = a;
+			break;
 		}
 	}
 	if(!p) {
@@ -291,9 +587,12 @@ void Paging::resetPage(uptr address, Paging::Directory *dir, bool soft) {
 }
 
 Paging::Directory *Paging::Directory::clone() {
-	Directory *dir = (Directory *)Memory::kalloc_a(sizeof(Directory));
-	memset(dir, 0, sizeof(Directory));
+	Directory *dir =
+	    (Directory *)Memory::kzalloc_a(sizeof(Directory), MemTag::Paging);
 
+	// the block only reserves its pages, but the processor is given
+	// the physical address of tablesPhysical, so map them now
+	Memory::prefault(dir, sizeof(Directory));
 	dir->physicalAddr = Paging::getPhysicalAddress((uptr)&dir->tablesPhysical);
 	// get a free page on present directory to act as a
 	// temp page pointing to the dest frame.
@@ -325,40 +624,73 @@ Paging::Directory *Paging::Directory::clone() {
 		}
 	}
 
-	// release the temporary page
+	// the regions of the kernel directory stay with it, as its tables
+	// are linked. the others are cloned, as the reserved pages are,
+	// except for those of the heap.
+	if(this != KernelDirectory) {
+		for(siz i = 0; i < MaxRegions; i++) {
+			if(regions[i].start - Task::DefaultHeapStart >=
+			   Task::DefaultHeapSize)
+				dir->regions[i] = regions[i];
+		}
+	}
+
+	// release the temporary page. it is not cloned, so the dest
+	// directory does not point to it.
 	Paging::resetPage(pageCopyAddress, this);
-	// the temporary page is also copied to the dest directory.
-	// who ever is pointing to that now, release it too
-	dir->tables[getTableIndex(pageCopyAddress)]
-	    ->pages[getPageNo(pageCopyAddress)]
-	    .free();
 
 	return dir;
 }
 
 Paging::Table *Paging::Table::clone(uptr &phys, siz table_idx,
                                     Page *pageCopyTemp,
-                                    uptr  pageCopyAddress) const {
-	Table *table = (Table *)Memory::kalloc_a(sizeof(Table));
-	memset(table, 0, sizeof(Table));
+                                    uptr  pageCopyAddress) {
+	Table *table = (Table *)Table::Cache.zalloc();
 	phys = Paging::getPhysicalAddress((uptr)table);
 
 	for(siz i = 0; i < Paging::PagesPerTable; i++) {
+		uptr address = (table_idx * Paging::PagesPerTable + i) *
+		               Paging::PageSize;
+		// the new task sets up a heap of its own there, so the heap
+		// of this one is left out, reservations and all
+		if(address - Task::DefaultHeapStart < Task::DefaultHeapSize)
+			continue;
 		if(!pages[i].inmem.frame) { // unallocated page, don't bother
+			// but keep the reservation, if any
+			table->pages[i].outmem.os_avail = pages[i].outmem.os_avail;
+			continue;
+		}
+		if(&pages[i] == pageCopyTemp)
+			continue;
+		if(pages[i].present && (pages[i].rw || pages[i].inmem.os_shared) &&
+		   Frame::share(pages[i].inmem.frame)) {
+			// both of the pages are made read only, and the first one
+			// which is written gets a copy of the frame in
+			// copyOnWrite
+			pages[i].rw              = 0;
+			pages[i].inmem.os_shared = 1;
+			Asm::invlpg(address);
+
+			table->pages[i].inmem.frame     = pages[i].inmem.frame;
+			table->pages[i].inmem.os_shared = 1;
+			table->pages[i].present         = 1;
+			table->pages[i].user            = pages[i].user;
+			table->pages[i].accessed        = pages[i].accessed;
+			table->pages[i].dirty           = pages[i].dirty;
 			continue;
 		}
 		// the temp page already contains an allocated frame,
 		// so just memcpy from source page to the temp page
-		memcpy((void *)(uptr)((table_idx * Paging::PagesPerTable + i) *
-		                      Paging::PageSize),
-		       (void *)(uptr)(pageCopyAddress), Paging::PageSize);
+		memcpy((void *)pageCopyAddress, (void *)address, Paging::PageSize);
 
 		// copy the frame
 		table->pages[i].inmem.frame = pageCopyTemp->inmem.frame;
 		// reset the frame of the temporary page
 		pageCopyTemp->inmem.frame = 0;
-		// allocate a new frame for next iteration
+		// allocate a new frame for next iteration, and drop the old
+		// one from the tlb before it is written through again
 		pageCopyTemp->alloc(false, true);
+		Asm::invlpg(pageCopyAddress);
 
 		// clone the flags
 		table->pages[i].present  = pages[i].present;
@@ -394,6 +726,124 @@ void Paging::Directory::dump() const {
 	Terminal::write("\n");
 }
 
+bool Paging::commitPage(uptr address, Directory *dir) {
+	Page *p = getPage(address, false, dir);
+	if(!p || p->present || !p->outmem.os_avail)
+		return false;
+	p->alloc(true, true);
+	Asm::invlpg(address);
+	memset((void *)(address & ~(PageSize - 1)), 0, PageSize);
+	return true;
+}
+
+bool Paging::copyOnWrite(uptr address, Directory *dir) {
+	Page *p = getPage(address, false, dir);
+	if(!p || !p->present || !p->inmem.os_shared)
+		return false;
+	// the contents are kept here while the page is remapped. the
+	// interrupts stay off, so that no other fault uses it meanwhile.
+	static u8 copy[PageSize];
+	address &= ~(PageSize - 1);
+	PAUSEI();
+	if(Frame::unshare(p->inmem.frame)) {
+		// the other pages keep the frame, this one gets a copy
+		memcpy(copy, (void *)address, PageSize);
+		p->inmem.frame     = 0;
+		p->inmem.os_shared = 0;
+		p->alloc(!p->user, true);
+		Asm::invlpg(address);
+		memcpy((void *)address, copy, PageSize);
+	} else {
+		// the others have already got their copies
+		p->inmem.os_shared = 0;
+		p->rw              = 1;
+		Asm::invlpg(address);
+	}
+	RESUMEI();
+	return true;
+}
+
+Paging::Region *Paging::addRegion(uptr start, uptr end, Region::Kind kind,
+                                  Directory *dir, const void *backing,
+                                  siz backingSize) {
+	// create the tables up front, so that the fault handler never has
+	// to allocate one
+	for(siz i = getTableIndex(start); i <= getTableIndex(end - 1); i++)
+		getPage(i * PagesPerTable * PageSize, true, dir);
+	Region *r = NULL;
+	PAUSEI();
+	for(siz i = 0; i < Directory::MaxRegions && !r; i++)
+		if(dir->regions[i].kind == Region::None)
+			r = &dir->regions[i];
+	if(r) {
+		r->start       = start;
+		r->end         = end;
+		r->backing     = backing;
+		r->backingSize = backingSize;
+		r->kind        = kind;
+	}
+	RESUMEI();
+	return r;
+}
+
+Paging::Region *Paging::findRegion(uptr address, Directory *dir) {
+	for(siz i = 0; i < Directory::MaxRegions; i++) {
+		Region &r = dir->regions[i];
+		if(r.kind != Region::None && address >= r.start && address < r.end)
+			return &r;
+	}
+	return NULL;
+}
+
+void Paging::resizeRegion(Region *r, uptr end) {
+	r->end = end;
+}
+
+void Paging::removeRegion(Region *r) {
+	r->kind = Region::None;
+}
+
+// maps a single page for faultIn
+static bool faultInPage(uptr address, Paging::Directory *dir) {
+	if(Paging::commitPage(address, dir))
+		return true;
+	Paging::Directory *owner = dir;
+	Paging::Region    *r     = Paging::findRegion(address, dir);
+	if(!r && dir != Paging::Directory::KernelDirectory) {
+		owner = Paging::Directory::KernelDirectory;
+		r     = Paging::findRegion(address, owner);
+	}
+	if(!r || r->kind == Paging::Region::Reserved)
+		return false;
+	Paging::Page *p = Paging::getPage(address, false, owner);
+	if(!p || p->present)
+		return false;
+	p->alloc(true, true);
+	Asm::invlpg(address);
+	siz offset = address - r->start, copied = 0;
+	if(r->kind == Paging::Region::Backed && offset < r->backingSize) {
+		copied = r->backingSize - offset;
+		if(copied > Paging::PageSize)
+			copied = Paging::PageSize;
+		memcpy((void *)address, (const u8 *)r->backing + offset, copied);
+	}
+	memset((void *)(address + copied), 0, Paging::PageSize - copied);
+	return true;
+}
+
+bool Paging::faultIn(uptr address, Directory *dir) {
+	address &= ~(PageSize - 1);
+	if(!faultInPage(address, dir))
+		return false;
+	// the pages after it are the ones a sequential access touches next
+	for(u32 i = 1; i <= FaultAround; i++) {
+		uptr next = address + i * PageSize;
+		if(next < address || !faultInPage(next, dir))
+			break;
+	}
+	return true;
+}
+
 void Paging::handlePageFault(Register *regs) {
 	// A page fault has occurred.
 	// The faulting address is stored in the CR2 register.
@@ -402,6 +852,14 @@ void Paging::handlePageFault(Register *regs) {
 
 	// The error code gives us details of what happened.
 	int present = regs->err_code & 0x1; // Page not present
+	// the first touch of a page which a heap has reserved, or which
+	// is in a region
+	if(!present && faultIn(faulting_address, Directory::CurrentDirectory))
+		return;
+	// the first write to a page which is shared after a clone
+	if(present && (regs->err_code & 0x2) &&
+	   copyOnWrite(faulting_address, Directory::CurrentDirectory))
+		return;
 	int rw      = regs->err_code & 0x2; // Write operation?
 	int us      = regs->err_code & 0x4; // Processor was in user-mode?
 	int reserved =
@@ -429,7 +887,11 @@ void Paging::handlePageFault(Register *regs) {
 		Terminal::write("reserved ");
 	}
 	if(id) {
-		Terminal::write("ifetch");
+		Terminal::write("ifetch ");
+	}
+	if(findRegion(faulting_address, Directory::CurrentDirectory) ||
+	   findRegion(faulting_address, Directory::KernelDirectory)) {
+		Terminal::write("reserved-region");
 	}
 	Terminal::write(") at ", Terminal::Mode::Hex, faulting_address,
 	                Terminal::Mode::Reset, "\n");
@@ -524,9 +986,14 @@ void Paging::init(Multiboot *boot) {
 		// Terminal::write("lastframe: ", Terminal::Mode::HexOnce, lastFrame,
 		//                "\n");
 	}
-	// map the first page
-	getPage_noheap(Heap::KHeapStart, true, Directory::KernelDirectory)
-	    ->alloc(true, true, lastFrame);
+	// map the pages of the heap object, which sits at the start of
+	// the kernel heap. it is larger than a page, and is written by
+	// Heap::init before the heap can map anything itself.
+	for(uptr i = Heap::KHeapStart; i < Heap::KHeapStart + sizeof(Heap);
+	    i += Paging::PageSize) {
+		lastFrame = getPage_noheap(i, true, Directory::KernelDirectory)
+		                ->alloc(true, true, lastFrame);
+	}
 	// we don't need to map heap
 
 	PROMPT("Dumping kernel directory: ");
@@ -536,11 +1003,26 @@ void Paging::init(Multiboot *boot) {
 
 	PROMPT("Initalizing kernel heap..");
 	Heap *heap = (Heap *)(uptr)(Heap::KHeapStart);
+	// the heap object comes out of the range, so that the heap does
+	// not run past the tables created for it above
 	heap->init(Heap::KHeapStart + sizeof(Heap),
-	           Heap::KHeapEnd - Heap::KHeapStart, Directory::KernelDirectory);
+	           Heap::KHeapEnd - Heap::KHeapStart - sizeof(Heap),
+	           Directory::KernelDirectory);
+	// the kernel heap is shared by all the tasks, so let it keep
+	// more of its empty buckets around than a task heap does
+	heap->setBucketRetention(2, 32, 128);
+	// the processor walks the tables by their physical address, so
+	// their slabs are mapped right away
+	Table::Cache.init("page table", sizeof(Table), PageSize, NULL, NULL,
+	                  MemTag::Paging, true);
 	// this address will be invalidated soon after scheduler activates
 	// the kernel task. it will reassign the heap.
 	Memory::kernelHeap = heap;
+	// the counts of the sharers of the frames take 2 MiB with 4 GiB
+	// of memory, which would not fit in the placement memory. on the
+	// heap, only the pages of the counts which are used get mapped.
+	Frame::sharers = (u16 *)Memory::kzalloc_a(
+	    Frame::numberOfSets * 32 * sizeof(u16), MemTag::Paging);
 
 	// if vbe is available, switch to it now
 	if(boot->flags & 0x800) {
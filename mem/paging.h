@@ -1,6 +1,7 @@
 #pragma once
 
 #include <boot/multiboot.h>
+#include <mem/objectcache.h>
 #include <misc/option.h>
 #include <sys/myos.h>
 #include <sys/system.h>
@@ -28,6 +29,15 @@ struct Paging {
 		static u32 *frames; // bitset of active frames
 		static siz  numberOfFrames;
 		static siz  numberOfSets; // number of values in 'frames' array
+		// summaries of 'frames', so that a free frame is found in a
+		// few bsf's however large the memory is. a bit is set in
+		// 'summary' for every set which has a free frame, and in
+		// 'topSummary' for every word of 'summary' which is not 0.
+		// they are kept up to date by set and clear.
+		static u32 *summary;
+		static siz  numberOfSummaries;
+		static u32 *topSummary;
+		static siz  numberOfTopSummaries;
 
 		static constexpr siz index(uptr frame) {
 			return (frame >>
@@ -44,41 +54,132 @@ struct Paging {
 		static void clear(uptr addr);
 		static bool test(uptr addr);
 
+		// finds a free frame, starting from lastFrame and wrapping
+		// around to the beginning
 		static bool findFirstFreeFrame(uptr &freeFrame, uptr lastFrame = 0);
-		// searches in the given range (inclusive in to_index, exclusive in
-		// to_offset)
-		static bool searchInRange(uptr from_index, uptr to_index, uptr &result);
+		// finds the first free frame at or after 'frame'
+		static bool findFreeFrom(uptr frame, uptr &result);
+		// finds the first set with a free frame at or after 'set'
+		static bool findFreeSet(siz set, siz &result);
+
+		// runs of physically contiguous frames come from a buddy
+		// allocator, over a pool taken out of the top of the memory
+		// by init. the frames of the pool are marked as used in
+		// 'frames', so the bitmap never gives them out, except by
+		// Page::alloc, from the pool, once the bitmap is full. a run
+		// of order n is 2^n frames long, and aligned to its length.
+		static const u32 MaxOrder = 10; // 4 MiB
+		// the pool takes 1/PoolShare of the memory, upto MaxPoolFrames
+		static const siz PoolShare     = 16;
+		static const siz MaxPoolFrames = 4096;
+		static const u16 NoBuddy       = 0xFFFF;
+		// one for each frame of the pool. only the ones of the first
+		// frame of a free run are used, to link it in its free list.
+		struct Buddy {
+			u16  next;
+			u16  prev;
+			u8   order;
+			bool free;
+		};
+		static uptr   poolStart; // first frame of the pool
+		static siz    poolFrames;
+		static u32    poolOrder; // order of the largest run in the pool
+		static Buddy *buddies;
+		static u16    freeBuddies[MaxOrder + 1];
+		static u32    freeOrders; // a bit is set for every list not empty
+
+		// carves the pool out of the usable regions of the map
+		static void initPool(Multiboot *boot);
+		static bool inPool(uptr frame) {
+			return frame - poolStart < poolFrames;
+		}
+		static void pushBuddy(u16 b, u32 order);
+		static void unlinkBuddy(u16 b);
+		// allocates 2^order contiguous frames, returning the first one
+		// in 'frame'. splitting a larger run takes O(log n).
+		static bool allocContiguous(u32 order, uptr &frame);
+		// frees a run allocated by allocContiguous, merging it with its
+		// free buddies, in O(log n). a run which is mapped by allocDMA
+		// must be unmapped softly first.
+		static void freeContiguous(uptr frame, u32 order);
+
+		// the number of pages which share a frame, besides the first
+		// one. only the frames of the pages marked os_shared are
+		// counted. it is allocated once the kernel heap is up.
+		static u16 *sharers;
+		// adds a page to the ones sharing the frame. returns false if
+		// the count is full, in which case the frame can't be shared.
+		static bool share(uptr frame);
+		// removes a page from the ones sharing the frame. returns
+		// false if it was the last one, which then owns the frame.
+		static bool unshare(uptr frame);
+
+		// take and release a single frame of the bitmap. the bitmap is
+		// shared by all the tasks and the page fault handler, so they
+		// keep the interrupts off while they use it.
+		static bool alloc(uptr &frame, uptr lastFrame = 0);
+		static void free(uptr frame);
+
+		// a bounded stack of free frames, owned by a task, so that the
+		// bursts of frames taken and released by the heap and by
+		// Directory::clone mostly stay off the bitmap. it is refilled
+		// from, and drained to, the bitmap in batches of CacheBatch.
+		static const siz CacheSize  = 32;
+		static const siz CacheBatch = CacheSize / 2;
+		struct Cache {
+			siz  count;
+			uptr frames[CacheSize];
+
+			void init();
+			bool alloc(uptr &frame);
+			void free(uptr frame);
+			// releases all the frames back to the bitmap. must be
+			// called before the cache goes out of use.
+			void drain();
+		};
+		// drains the caches of all the tasks, when the bitmap runs
+		// out of frames. returns false if they held none.
+		static bool reclaimCaches();
 	};
 
 	struct Page {
-		u8 present : 1;   // Page present in memory
-		u8 rw : 1;        // Read-only if clear, readwrite if set
-		u8 user : 1;      // Supervisor level only if clear
-		u8 accessed : 1;  // Has the page been accessed since last
-		                  // refresh?
-		u8 dirty : 1;     // Has the page been written to since last
-		                  // refresh?
-		u8 os_shared : 1; // Is the page shared between multiple tasks?
-		u8 unused_1 : 2;  // unused
+		u8 present : 1;  // Page present in memory
+		u8 rw : 1;       // Read-only if clear, readwrite if set
+		u8 user : 1;     // Supervisor level only if clear
+		u8 unused_1 : 2; // write through and cache disable, unused
+		u8 accessed : 1; // Has the page been accessed since last
+		                 // refresh?
+		u8 dirty : 1;    // Has the page been written to since last
+		                 // refresh?
+		u8 unused_3 : 1; // page attribute table, unused
 		// if present is 0, the processor ignores all other bits,
 		// so we use them however we want
 		// we mark custom flags with os_*
 		union {
 			// struct that represents an in-memory page
 			struct {
-				u16 unused_2 : 4; // unused
+				u16 unused_2 : 1; // global, unused
+				// set on the pages which share their frame with the
+				// pages of other directories after a clone. they are
+				// read only, and the first write to one of them gives
+				// it a copy of the frame. bits 9 - 11 are free for us.
+				u16 os_shared : 1;
+				u16 unused_4 : 2; // unused
 				u32 frame : 20;   // Frame address (shifted right 12 bits)
 			} __attribute__((packed)) inmem;
 			// struct that represent a page not in memory
 			struct {
-				u8  os_avail : 1;   // marks if the page is available to alloc
+				// marks a page which is reserved by a heap. it is
+				// mapped to a zeroed frame when it is first touched.
+				u8  os_avail : 1;
 				u32 os_unused : 23; // unused bits for now
 			} __attribute__((packed)) outmem;
 		} __attribute__((packed));
 		// optionally takes the last allocated frame index to pass
 		// to findFirstFreeFrame, so that it does not start searching
 		// from the beginning.
-		// returns the allocated frame
+		// returns the allocated frame. a reserved page stops being
+		// reserved once it is allocated.
 		uptr alloc(bool isKernel, bool isWritable, uptr lastFrame = 0);
 		// this sets up a frame at the specified physical address,
 		// does not toggle any Frame bit
@@ -101,8 +202,31 @@ struct Paging {
 		// new frame, resetting frame of the temp page.
 		// tempAddr contains the address where the temp
 		// page points to.
+		// the writable pages are not copied, but shared with the
+		// new table, and marked os_shared in both. only the read
+		// only pages are copied right away.
 		Table *clone(uptr &phys, siz table_idx, Page *pageCopyTemp,
-		             uptr tempAddr) const;
+		             uptr tempAddr);
+
+		// tables, once the heap is up, are allocated from here
+		static ObjectCache Cache;
+	};
+
+	// a range of the address space whose pages are mapped on their
+	// first touch, instead of when the range is set up. the fault
+	// handler looks a not present page up in the regions of the
+	// current directory, and then in those of the kernel directory.
+	struct Region {
+		enum Kind : u8 {
+			None,       // the slot is free
+			Reserved,   // taken, but not backed, so a touch is an error
+			DemandZero, // mapped to zeroed frames
+			Backed      // mapped to copies of 'backing', zero after it
+		};
+		uptr        start, end; // page aligned, [start, end)
+		const void *backing;    // kernel memory, for Backed only
+		siz         backingSize;
+		Kind        kind;
 	};
 
 	struct Directory {
@@ -118,6 +242,10 @@ struct Paging {
 		    may be in a different location in virtual memory.
 		*/
 		siz physicalAddr;
+		// the regions are few, and a lookup walks all of them. when
+		// they are used up, the callers reserve the pages one by one.
+		static const siz MaxRegions = 16;
+		Region           regions[MaxRegions];
 
 		static Directory *CurrentDirectory;
 		static Directory *KernelDirectory;
@@ -155,6 +283,36 @@ struct Paging {
 	// if it is a soft reset, it does not call Frame::free, assuming
 	// that this frame may be referenced by another page.
 	static void resetPage(uptr address, Directory *dir, bool soft = false);
+	// maps a zeroed frame to the page containing address, if it is
+	// reserved and not mapped yet. returns true if it did.
+	static bool commitPage(uptr address, Directory *dir);
+	// makes the page containing address writable, if it is shared
+	// after a clone, copying its frame if it is still used by other
+	// pages. returns true if it did.
+	static bool copyOnWrite(uptr address, Directory *dir);
+
+	// adds a region of the given kind over [start, end) to the
+	// directory. returns NULL if the directory has no free slot. the
+	// regions of the kernel directory must lie in tables which exist
+	// already, as those of the kernel heap, so that the pages mapped
+	// in them are seen by all the directories.
+	static Region *addRegion(uptr start, uptr end, Region::Kind kind,
+	                         Directory *dir, const void *backing = NULL,
+	                         siz backingSize = 0);
+	// returns the region of the directory containing address, if any
+	static Region *findRegion(uptr address, Directory *dir);
+	// moves the end of the region, which must be page aligned
+	static void resizeRegion(Region *r, uptr end);
+	static void removeRegion(Region *r);
+	// maps the page containing address, if it is reserved by a heap
+	// or in a region which is not just Reserved, and up to
+	// FaultAround pages after it which would be mapped the same way.
+	// returns true if it mapped the page.
+	static bool faultIn(uptr address, Directory *dir);
+	// the number of pages faultIn maps after the one which is
+	// touched, so that a sequential access faults once every
+	// FaultAround + 1 pages. 0 turns it off.
+	static u32 FaultAround;
 
 	static void handlePageFault(Register *r);
 
@@ -1,19 +1,216 @@
+#include <arch/x86/asm.h>
 #include <drivers/keyboard.h>
 #include <drivers/terminal.h>
+#include <mem/heap.h>
+#include <mem/heapprofiler.h>
+#include <mem/heaptrace.h>
 #include <mem/memory.h>
+#include <mem/objectcache.h>
+#include <mem/paging.h>
 #include <misc/shell.h>
+#include <sched/scheduler.h>
 #include <sys/string.h>
 
 void handle_hello(int num) {
 	Terminal::info("Hello ", num);
 }
 
+void handle_slabinfo() {
+	ObjectCache::dumpAll();
+}
+
+// compares the cost of allocating and freeing objects of 'size'
+// bytes one at a time against doing it in batches
+void handle_heapbench(int size) {
+	static const int Batch  = 64;
+	static const int Rounds = 64;
+	void            *objects[Batch];
+	if(size <= 0) {
+		Terminal::err("Invalid size!");
+		return;
+	}
+	u64 start = Asm::rdtsc();
+	for(int r = 0; r < Rounds; r++) {
+		for(int i = 0; i < Batch; i++) objects[i] = Memory::alloc(size);
+		for(int i = 0; i < Batch; i++) Memory::free(objects[i]);
+	}
+	u32 single = (Asm::rdtsc() - start) / (Batch * Rounds);
+	start      = Asm::rdtsc();
+	for(int r = 0; r < Rounds; r++) {
+		siz n = Memory::alloc_bulk(size, Batch, objects);
+		Memory::free_bulk(objects, n);
+	}
+	u32 bulk = (Asm::rdtsc() - start) / (Batch * Rounds);
+	Terminal::info("Ticks per object: single: ", single, " bulk: ", bulk);
+}
+
+// measures the ticks it takes to find and take a free frame when 10%,
+// 50% and 95% of the frames are in use. the memory is filled from the
+// bottom, as the frame allocator does, so the free frames are all
+// above the used ones. the frames taken are given back at the end.
+void handle_framebench() {
+	static const siz Levels[] = {10, 50, 95};
+	static const siz Batch    = 64;
+	static const siz Rounds   = 64;
+	uptr             got[Batch];
+	siz              total = Paging::Frame::numberOfSets * 32;
+	// the frames taken to fill the memory, mapped upfront, as no
+	// page can be mapped while we hold the frames
+	uptr *taken = (uptr *)Memory::kalloc(total * sizeof(uptr));
+	Memory::prefault(taken, total * sizeof(uptr));
+	siz numTaken = 0;
+
+	Scheduler::suspend();
+	siz used = 0;
+	for(siz i = 0; i < Paging::Frame::numberOfSets; i++)
+		used += __builtin_popcount(Paging::Frame::frames[i]);
+	for(siz level : Levels) {
+		uptr f;
+		while(used * 100 < total * level &&
+		      Paging::Frame::findFirstFreeFrame(f)) {
+			Paging::Frame::set(f * Paging::PageSize);
+			taken[numTaken++] = f;
+			used++;
+		}
+		u64 sum = 0, max = 0;
+		for(siz r = 0; r < Rounds; r++) {
+			siz n = 0;
+			for(; n < Batch; n++) {
+				u64 start = Asm::rdtsc();
+				if(!Paging::Frame::findFirstFreeFrame(got[n]))
+					break;
+				Paging::Frame::set(got[n] * Paging::PageSize);
+				u64 t = Asm::rdtsc() - start;
+				sum += t;
+				if(t > max)
+					max = t;
+			}
+			for(siz i = 0; i < n; i++)
+				Paging::Frame::clear(got[i] * Paging::PageSize);
+		}
+		u32 avg = sum / (Batch * Rounds);
+		Terminal::info("Frames in use: ", (u32)(used * 100 / total),
+		               "%, ticks per frame: avg ", avg, " max ", (u32)max);
+	}
+	while(numTaken > 0)
+		Paging::Frame::clear(taken[--numTaken] * Paging::PageSize);
+	Scheduler::resume();
+	Memory::kfree(taken);
+}
+
+// gives the free memory of the heaps back to the frame allocator
+void handle_trim() {
+	((Heap *)&Scheduler::CurrentTask->heap)->trim();
+	Memory::kernelHeap->trim();
+}
+
+// prints the statistics of the heap of a task. the heap of the
+// kernel task, which has id 0, is the kernel heap.
+void handle_heapstat(int id) {
+	Scheduler::suspend();
+	Task *t = Scheduler::findTask(id);
+	if(!t || t->heap.heapLock.isLocked()) {
+		Scheduler::resume();
+		Terminal::err(t ? "The heap is busy, try again!" : "No such task!");
+		return;
+	}
+	// the heap of a task is only mapped in its own directory. nothing
+	// else runs while we are suspended, so it is safe to switch.
+	Paging::switchPageDirectory(t->pageDirectory);
+	Heap::Stats st = t->heap.stats();
+	Paging::switchPageDirectory(Scheduler::CurrentTask->pageDirectory);
+	// the task may exit once we resume, so everything is taken now.
+	// the counters are kept in the task, outside of the heap.
+	static Heap::ClassStats cs;
+	t->heap.classStats(cs);
+	// the magazines in front of the kernel heap, with their hit rate
+	static Heap::MagazineCache mc;
+	mc = t->kernelCache;
+	Scheduler::resume();
+	Terminal::write("Heap of task ", id, "\n");
+	st.dump();
+	cs.dump();
+	mc.dump();
+	Terminal::write("\n");
+}
+
 Shell::Command *Shell::commands    = NULL;
 int             Shell::numCommands = 0;
 bool            runShell           = true;
 
+// prints how much of the kernel heap each subsystem holds
+void handle_memtags() {
+	Memory::kernelHeap->dumpTags();
+}
+
+// samples the allocations on all the heaps every 'interval' bytes,
+// or stops sampling if it is 0
+void handle_heapprof(int interval) {
+	if(interval < 0) {
+		Terminal::err("Invalid interval!");
+		return;
+	}
+	HeapProfiler::start(interval);
+}
+
+// prints the 'count' call stacks which allocated the most in the
+// samples, or all of them if count is 0
+void handle_heapprofdump(int count) {
+	if(count < 0) {
+		Terminal::err("Invalid count!");
+		return;
+	}
+	HeapProfiler::dump(count);
+}
+
+// writes all the call stacks in the samples over serial, which can
+// hold much more of them than the screen
+void handle_heapprofserial() {
+	Terminal::Output o = Terminal::CurrentOutput;
+	Terminal::write(Terminal::Output::Serial);
+	HeapProfiler::dump();
+	Terminal::write(o);
+}
+
+// starts recording the operations on the heaps if 'on' is set,
+// dropping the ones recorded so far, or stops it
+void handle_heaptrace(int on) {
+	if(on)
+		HeapTrace::start();
+	else
+		HeapTrace::stop();
+}
+
+// streams the recorded operations over the second serial port, to be
+// replayed on the host by tools/heaphost
+void handle_heaptracestream() {
+	HeapTrace::stream();
+}
+
+// sets the number of pages which are mapped after the one a fault
+// touches, 0 to map only that one
+void handle_faultaround(int pages) {
+	if(pages < 0) {
+		Terminal::err("Invalid count!");
+		return;
+	}
+	Paging::FaultAround = pages;
+}
+
 void Shell::init() {
 	addCommand("hello", handle_hello);
+	addCommand("slabinfo", handle_slabinfo);
+	addCommand("heapbench", handle_heapbench);
+	addCommand("framebench", handle_framebench);
+	addCommand("trim", handle_trim);
+	addCommand("heapstat", handle_heapstat);
+	addCommand("memtags", handle_memtags);
+	addCommand("heapprof", handle_heapprof);
+	addCommand("heapprofdump", handle_heapprofdump);
+	addCommand("heapprofserial", handle_heapprofserial);
+	addCommand("heaptrace", handle_heaptrace);
+	addCommand("heaptracestream", handle_heaptracestream);
+	addCommand("faultaround", handle_faultaround);
 }
 
 void Shell::processBuffer(const char *buffer, int len) {
@@ -45,15 +242,11 @@ void Shell::processBuffer(const char *buffer, int len) {
 }
 
 void Shell::registerCommand(Command c) {
-	Command *bak =
-	    (Command *)Memory::alloc(sizeof(Command) * (numCommands + 1));
-	if(numCommands != 0)
-		memcpy(bak, commands, sizeof(Command) * numCommands);
-	bak[numCommands]         = c;
-	bak[numCommands].command = strdup(c.command);
+	commands = (Command *)Memory::realloc(commands,
+	                                      sizeof(Command) * (numCommands + 1));
+	commands[numCommands]         = c;
+	commands[numCommands].command = strdup(c.command);
 	numCommands++;
-	Memory::free(commands);
-	commands = bak;
 }
 
 void Shell::run() {
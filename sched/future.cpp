@@ -2,6 +2,8 @@
 #include <sched/future.h>
 #include <sched/scheduler.h>
 
+ObjectCache Future<void>::Cache = ObjectCache();
+
 FutureBase::FutureBase() {
 	isAvailable  = false;
 	lock         = SpinLock();
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <mem/objectcache.h>
 #include <sched/scopedlock.h>
 #include <sched/spinlock.h>
 #include <sched/task.h>
@@ -21,6 +22,16 @@ template <typename T> struct Future : FutureBase {
 	Future() : FutureBase() {
 	}
 
+	// futures of each type come from a cache of their own
+	static ObjectCache Cache;
+	static Future     *create() {
+		Cache.ensureInit("future", sizeof(Future), alignof(Future), NULL,
+		                 NULL, MemTag::Scheduler);
+		Future *f = (Future *)Cache.alloc();
+		*f        = Future();
+		return f;
+	}
+
 	void set(T v) {
 		ScopedLock sl(lock);
 		value = v;
@@ -33,11 +44,22 @@ template <typename T> struct Future : FutureBase {
 	}
 };
 
+template <typename T> ObjectCache Future<T>::Cache = ObjectCache();
+
 template <> struct Future<void> : FutureBase {
 
 	Future() : FutureBase() {
 	}
 
+	static ObjectCache Cache;
+	static Future     *create() {
+		Cache.ensureInit("future", sizeof(Future), alignof(Future), NULL,
+		                 NULL, MemTag::Scheduler);
+		Future *f = (Future *)Cache.alloc();
+		*f        = Future();
+		return f;
+	}
+
 	void set() {
 		ScopedLock l(lock);
 		awakeAllNoLock();
@@ -9,6 +9,7 @@ volatile Task *Scheduler::CurrentTask             = NULL;
 volatile Task *Scheduler::FinishedTasks           = NULL;
 SpinLock       Scheduler::SchedulerLock           = SpinLock();
 Semaphore      Scheduler::CleanupSemaphore        = Semaphore();
+Task          *Scheduler::AllTasks                = NULL;
 u32            Scheduler::RecursiveSuspendCounter = 0;
 u64            Scheduler::TscTicksPerMs           = 0;
 u64            Scheduler::TscTicksPerTimeSlice    = 0;
@@ -16,8 +17,11 @@ u64            Scheduler::TscTicksPerTimeSlice    = 0;
 void Scheduler::prepare(Task *t, void *future_addr, void *future_set,
                         u32 numargs) {
 	// PROMPT_INIT("Scheduler::prepare", Orange);
-	// allocate a new stack
-	t->stackptr = Memory::kalloc_a(Task::DefaultStackSize);
+	// allocate a new stack, unless the task is recycled
+	// and already has one
+	if(!t->stackptr)
+		t->stackptr =
+		    Memory::kalloc_a(Task::DefaultStackSize, MemTag::Scheduler);
 	uptr *newStack =
 	    (uptr *)(t->stackptr) + Task::DefaultStackSize / sizeof(uptr) - 1;
 	// stack for task finish
@@ -63,8 +67,37 @@ void Scheduler::prepare(Task *t, void *future_addr, void *future_set,
 
 	t->pageDirectory = Paging::Directory::CurrentDirectory->clone();
 	// PROMPT("here");
-	t->heap.init(Task::DefaultHeapStart, Task::DefaultHeapSize,
-	             t->pageDirectory);
+	// the heap is set up when the task first allocates from it
+	t->heap.reserve(Task::DefaultHeapStart, Task::DefaultHeapSize,
+	                t->pageDirectory);
+	registerTask(t);
+}
+
+void Scheduler::registerTask(Task *t) {
+	suspend();
+	t->prevInAll = NULL;
+	t->nextInAll = AllTasks;
+	if(AllTasks)
+		AllTasks->prevInAll = t;
+	AllTasks = t;
+	resume();
+}
+
+void Scheduler::unregisterTask(Task *t) {
+	suspend();
+	if(t->prevInAll)
+		t->prevInAll->nextInAll = t->nextInAll;
+	else
+		AllTasks = t->nextInAll;
+	if(t->nextInAll)
+		t->nextInAll->prevInAll = t->prevInAll;
+	resume();
+}
+
+Task *Scheduler::findTask(u32 id) {
+	Task *t = AllTasks;
+	while(t && t->id != id) t = t->nextInAll;
+	return t;
 }
 
 void Scheduler::appendTask(Task *t) {
@@ -217,19 +250,32 @@ extern uptr scheduler_scheduleNext(Register *oldRegisters) {
 
 void Scheduler::cleanupTask() {
 	// PROMPT_INIT("CleanupTask", Orange);
+	u64 lastTrim = Asm::rdtsc();
 	while(true) {
 		// acquire the semaphore to make sure we have
 		// tasks to be cleaned
 		CleanupSemaphore.acquire();
-		// for now, just release the stack
 		// PROMPT("Cleaning up");
-		Memory::kfree(FinishedTasks->stackptr);
 		// Memory::kfree(FinishedTasks->heap);
 		Task *OldFinishedTask = (Task *)FinishedTasks;
+		// return the kernel heap blocks cached by the task
+		Memory::kernelHeap->drain(OldFinishedTask->kernelCache);
+		// and the frames
+		OldFinishedTask->frameCache.drain();
 		// u32   oldId           = OldFinishedTask->id;
 		FinishedTasks = FinishedTasks->nextInList;
-		Memory::kfree(OldFinishedTask);
+		unregisterTask(OldFinishedTask);
+		// the task goes back to the cache with its stack, which
+		// is reused by the next task allocated from there
+		Task::Cache.free(OldFinishedTask);
 		// Terminal::write("Cleaned up: Task#", oldId, "\n");
+		// every once in a while, give back the memory which the
+		// kernel heap is holding on to after a peak
+		u64 now = Asm::rdtsc();
+		if(now - lastTrim >= TrimIntervalMs * TscTicksPerMs) {
+			Memory::kernelHeap->trim();
+			lastTrim = now;
+		}
 	}
 }
 
@@ -239,7 +285,9 @@ void Scheduler::init() {
 	PROMPT("Creating kernel task..");
 	SchedulerLock    = SpinLock();
 	CleanupSemaphore = Semaphore(0);
-	Task *t          = Memory::kcreate<Task>();
+	Task::Cache.init("task", sizeof(Task), alignof(Task), Task::construct,
+	                 NULL, MemTag::Scheduler);
+	Task *t                  = Task::create();
 	CurrentTask = ReadyQueue = t;
 	t->state                 = Task::State::Scheduled;
 	t->prev                  = t;
@@ -247,6 +295,8 @@ void Scheduler::init() {
 	t->pageDirectory         = Paging::Directory::KernelDirectory;
 	t->heap                  = *Memory::kernelHeap;
 	Memory::kernelHeap       = &t->heap;
+	// interrupts are still off, so it is linked directly
+	AllTasks = t;
 	PROMPT("Initializing timer..");
 	Timer::init();
 	PROMPT("Calibrating TSC..");
@@ -15,9 +15,14 @@ struct Scheduler {
 	static volatile Task *FinishedTasks;
 	static SpinLock       SchedulerLock;
 	static Semaphore      CleanupSemaphore;
+	// all the tasks which are not cleaned up yet, to find them by id
+	static Task *AllTasks;
 
 	// amount of time each task should run before it is switched
 	static const u64 TimeSliceMs = 150;
+	// minimum time between two trims of the kernel heap by the
+	// cleanup task
+	static const u64 TrimIntervalMs = 5000;
 	// priority queue based on lastStartTime, which acts as
 	// time of resume
 	static volatile Task *WaitingQueue;
@@ -49,8 +54,8 @@ struct Scheduler {
 	template <typename T, typename... F>
 	static Future<T> *submit(T (*run)(F... args), F... args) {
 		// result has to be accessible from both the tasks
-		Future<T> *result = Memory::kcreate<Future<T>>();
-		Task      *t      = Memory::kcreate<Task>();
+		Future<T> *result = Future<T>::create();
+		Task      *t      = Task::create();
 		t->runner         = (void *)run;
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wpmf-conversions"
@@ -99,6 +104,13 @@ struct Scheduler {
 	// if the task state of the task is Unscheduled,
 	// it just marks it as scheduled and returns
 	static void appendTask(Task *t);
+	// adds and removes a task from AllTasks
+	static void registerTask(Task *t);
+	static void unregisterTask(Task *t);
+	// returns the task with the given id, or NULL. the task may be
+	// cleaned up anytime after this returns, so the caller must
+	// keep the scheduler suspended as long as it uses the task.
+	static Task *findTask(u32 id);
 	// removes the current task from ready queue,
 	// and hopefully, sometime in the future,
 	// releases its resources.
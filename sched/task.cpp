@@ -32,16 +32,35 @@ void Task::setKernelStack(uptr stack_) {
 	taskStateSegment.esp0 = stack_;
 }
 
-u32 Task::NextPid = 0;
+u32         Task::NextPid = 0;
+ObjectCache Task::Cache   = ObjectCache();
 
 Task::Task() {
+	stackptr = NULL;
+	reset();
+}
+
+void Task::construct(void *task) {
+	((Task *)task)->stackptr = NULL;
+}
+
+Task *Task::create() {
+	Task *t = (Task *)Cache.alloc();
+	t->reset();
+	return t;
+}
+
+void Task::reset() {
 	id   = NextPid++;
 	prev = next = NULL;
 	nextInList  = NULL;
+	prevInAll = nextInAll = NULL;
 	state       = State::New;
 	memset(&regs, 0, sizeof(Register));
 	regs.fs = regs.es = regs.ds = regs.gs = 0x10;
 	regs.cs                               = 0x08;
 	lastStartTime = elapsedTime = 0;
 	yielded                     = false;
+	kernelCache.init();
+	frameCache.init();
 }
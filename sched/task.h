@@ -1,6 +1,7 @@
 #pragma once
 
 #include <mem/heap.h>
+#include <mem/objectcache.h>
 #include <mem/paging.h>
 #include <sys/myos.h>
 #include <sys/string.h>
@@ -90,10 +91,28 @@ struct Task {
 	bool yielded;     // if the task is yielded, this is set to true, so that
 	              // scheduler can force switch task even if its timeslice is
 	              // not expired
+	// neighbors in Scheduler::AllTasks
+	Task *prevInAll, *nextInAll;
+	// blocks of the kernel heap cached for this task, so that
+	// kalloc/kfree can skip the kernel heap lock most of the time
+	Heap::MagazineCache kernelCache;
+	// free frames cached for this task, in front of the frame bitmap
+	Paging::Frame::Cache frameCache;
 
 	static const siz DefaultStackSize = 1024 * 4; // let's make it 4KiB for now
 	static const siz DefaultHeapSize =
 	    1024 * 1024; // let's make it 1MiB for now
 	static const siz DefaultHeapStart = 0x40000000; // base address for the heap
 	Task();
+	// brings a task back to the state of a newly created one. the
+	// stack stays allocated, so that a task recycled from the cache
+	// does not need a new one.
+	void reset();
+
+	// tasks are allocated from here. a task which is freed keeps
+	// its stack, and gets it back when it's allocated again.
+	static ObjectCache Cache;
+	static void        construct(void *task);
+	// returns a task from the cache, reset to run
+	static Task *create();
 };
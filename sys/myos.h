@@ -19,5 +19,6 @@ typedef intptr_t  iptr;
 
 struct Limits {
 	static const siz SizMax = SIZE_MAX;
+	static const u16 U16Max = UINT16_MAX;
 	static const u32 U32Max = UINT32_MAX;
 };
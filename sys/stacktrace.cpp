@@ -69,6 +69,28 @@ SymbolDetails getSymbolName(u32 ip) {
 	return {NULL, 0};
 }
 
+u32 Stacktrace::capture(uptr *eips, u32 max, u32 skip) {
+	StackFrame *stk;
+	asm("mov %%ebp,%0" : "=r"(stk)::);
+	u32 count = 0;
+	for(; stk && count < max; stk = (StackFrame *)stk->next) {
+		if(skip > 0)
+			skip--;
+		else
+			eips[count++] = stk->eip;
+	}
+	return count;
+}
+
+void Stacktrace::printSymbol(uptr eip) {
+	SymbolDetails symdet = getSymbolName(eip);
+	if(!symdet.sym)
+		Terminal::write(Terminal::Mode::HexOnce, eip);
+	else
+		Terminal::write(symdet.sym, "+", Terminal::Mode::HexOnce,
+		                eip - symdet.symStart);
+}
+
 void Stacktrace::print(void *ebp) {
 	Terminal::write("\t\tStack Trace\n");
 	Terminal::write("===========================\n");
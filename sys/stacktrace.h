@@ -16,6 +16,13 @@ struct Stacktrace {
 
 	static void dumpSymbols();
 	static void loadSymbols(Multiboot *boot);
+	// walks the frames of the caller, skipping the innermost 'skip'
+	// of them, and stores upto 'max' return addresses in 'eips'.
+	// returns the number of addresses stored.
+	static u32 capture(uptr *eips, u32 max, u32 skip = 0);
+	// writes the symbol containing 'eip' as symbol+offset, or the
+	// bare address if no symbol contains it
+	static void printSymbol(uptr eip);
 	static void print(void *ebp = NULL);
 	static void print(uptr ebp) {
 		union {
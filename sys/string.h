@@ -25,6 +25,8 @@ extern void *memmove(void *dest, const void *source, siz size);
 
 // defined in memory.cpp
 extern void *malloc(size_t size);
+extern void *realloc(void *mem, size_t size);
+extern void *calloc(size_t count, size_t size);
 extern void  free(void *mem);
 extern void  abort();
 }
@@ -0,0 +1,168 @@
+#include "check.h"
+
+#include <stdio.h>
+
+static bool fail(const char *what, uptr where = 0) {
+	printf("heap check failed: %s (%#lx)\n", what, (unsigned long)where);
+	return false;
+}
+
+// the headers of the large region must be contiguous, coalesced, and
+// exactly the ones in the free lists
+static bool checkHeaders(Heap &h, bool empty) {
+	uptr          addr = h.largeAllocationStart;
+	Heap::Header *prev = NULL;
+	siz           used = 0, free = 0;
+	while(addr < h.largeAllocationEnd) {
+		Heap::Header *x = (Heap::Header *)addr;
+		if((x->magic & ~1u) != Heap::Header::Magic) {
+			// an aligned allocation may leave a gap before the first
+			if(!prev) {
+				addr += 8;
+				continue;
+			}
+			return fail("bad header magic", addr);
+		}
+		if(x->previousHeader != prev)
+			return fail("bad previous header", addr);
+		if(x->magic & 1) {
+			used++;
+		} else {
+			free++;
+			if(prev && !(prev->magic & 1))
+				return fail("free headers not coalesced", addr);
+		}
+		prev = x;
+		addr += x->allocationSize;
+	}
+	if(addr != h.largeAllocationEnd)
+		return fail("headers overrun the large region", addr);
+	siz listed = 0;
+	for(siz i = 0; i < Heap::FirstLevelCount; i++) {
+		for(siz j = 0; j < Heap::SecondLevelCount; j++) {
+			bool bit = (h.secondLevelMap[i] >> j) & 1;
+			if(bit != (h.freeHeaders[i][j] != NULL))
+				return fail("free list bitmap mismatch", i << 8 | j);
+			Heap::Header *q = NULL;
+			for(Heap::Header *x = h.freeHeaders[i][j]; x;
+			    q = x, x = x->nextFree) {
+				siz fl, sl;
+				Heap::mapHeaderSize(x->allocationSize, fl, sl);
+				if(x->magic != Heap::Header::Magic || x->prevFree != q ||
+				   fl != i || sl != j)
+					return fail("bad free list entry", (uptr)x);
+				listed++;
+			}
+		}
+	}
+	if(listed != free)
+		return fail("free headers missing from the lists", listed);
+	if(empty && (used || free != 1))
+		return fail("large region not empty", used);
+	return true;
+}
+
+static bool checkBuckets(Heap &h, bool empty) {
+	siz totalEmpty = 0, total = 0;
+	for(siz i = 0; i < Heap::BlockCount; i++) {
+		Heap::SizeClass &sc    = h.sizeClasses[i];
+		siz              count = 0, all = 0;
+		for(Heap::Bucket *b = sc.empty; b; b = b->nextBucket, count++)
+			if(!b->isEmpty())
+				return fail("used bucket in the empty list", b->startMem);
+		for(Heap::Bucket *b = sc.partial; b; b = b->nextBucket, all++)
+			if(b->isEmpty() || !b->numAvailBlocks)
+				return fail("bad bucket in the partial list", b->startMem);
+		for(Heap::Bucket *b = sc.full; b; b = b->nextBucket, all++)
+			if(b->numAvailBlocks)
+				return fail("bad bucket in the full list", b->startMem);
+		if(count != sc.emptyCount)
+			return fail("emptyCount mismatch", i);
+		if(count + all != sc.bucketCount)
+			return fail("bucketCount mismatch", i);
+		if(empty && all)
+			return fail("buckets left in use", i);
+		totalEmpty += count;
+		total += count + all;
+	}
+	if(totalEmpty != h.emptyBuckets)
+		return fail("emptyBuckets mismatch", totalEmpty);
+	if(total != h.bucketsInUse)
+		return fail("bucketsInUse mismatch", total);
+	return true;
+}
+
+static bool checkSpans(Heap &h, bool empty) {
+	siz total = 0;
+	for(siz i = 0; i < Heap::MediumClassCount; i++) {
+		Heap::MediumClass &mc    = h.mediumClasses[i];
+		siz                count = 0, all = 0;
+		for(Heap::Span *s = mc.full; s; s = s->nextSpan, all++)
+			if(s->numAvailBlocks || s->mediumClass != i)
+				return fail("bad span in the full list", s->startMem);
+		for(Heap::Span *s = mc.partial; s; s = s->nextSpan, all++) {
+			siz bits = __builtin_popcount(s->freeMap[0]) +
+			           __builtin_popcount(s->freeMap[1]);
+			if(!s->numAvailBlocks || s->isEmpty() ||
+			   bits != s->numAvailBlocks)
+				return fail("bad span in the partial list", s->startMem);
+		}
+		for(Heap::Span *s = mc.empty; s; s = s->nextSpan, count++)
+			if(!s->isEmpty())
+				return fail("used span in the empty list", s->startMem);
+		if(count != mc.emptyCount)
+			return fail("span emptyCount mismatch", i);
+		if(count + all != mc.spanCount)
+			return fail("spanCount mismatch", i);
+		if(empty && all)
+			return fail("spans left in use", i);
+		total += count + all;
+	}
+	if(total != h.spansInUse)
+		return fail("spansInUse mismatch", total);
+	return true;
+}
+
+// the runs must cover the huge region, be coalesced, and have only
+// the pages of the runs in use mapped or reserved
+static bool checkHugeRuns(Heap &h, bool empty) {
+	siz  page = 0, runs = 0;
+	bool lastFree = false;
+	while(page < h.numHugePages) {
+		u32 tag   = h.hugeRuns[page];
+		siz pages = Heap::hugePages(tag);
+		bool used = tag & 1;
+		if(!pages || page + pages > h.numHugePages ||
+		   h.hugeRuns[page + pages - 1] != tag)
+			return fail("bad huge run", page);
+		if(!used && lastFree)
+			return fail("free huge runs not coalesced", page);
+		for(siz i = 0; i < pages; i++) {
+			uptr a = h.hugeAllocationStart + (page + i) * Paging::PageSize;
+			Paging::Page *p        = Paging::getPage(a, false, NULL);
+			bool          reserved = p->outmem.os_avail ||
+			                Paging::findRegion(a, NULL) != NULL;
+			if((p->present || reserved) != used)
+				return fail("huge page mapping mismatch", page + i);
+		}
+		lastFree = !used;
+		page += pages;
+		runs++;
+	}
+	if(empty && h.numHugePages && runs != 1)
+		return fail("huge region not empty", runs);
+	return true;
+}
+
+bool checkHeap(Heap &h, bool empty) {
+	if(!h.ready)
+		return true;
+	if((uptr)h.hugeRuns + h.hugeAdditionalMem > h.bucketAllocationStart)
+		return fail("structures overlap the buckets");
+	if(!checkHeaders(h, empty) || !checkBuckets(h, empty) ||
+	   !checkSpans(h, empty) || !checkHugeRuns(h, empty))
+		return false;
+	if(empty && h.bytesInUse)
+		return fail("bytes left in use", h.bytesInUse);
+	return true;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <mem/heap.h>
+
+// walks all the structures of a heap, and checks that they agree with
+// each other. if 'empty' is set, it also checks that nothing is
+// allocated. returns false, after printing the first problem it
+// finds, if they don't.
+bool checkHeap(Heap &h, bool empty);
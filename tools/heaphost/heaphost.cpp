@@ -0,0 +1,455 @@
+// runs the kernel heap on the host, to iterate on the allocator
+// without booting the kernel. the heap is compiled as is, against
+// a mock paging which backs the pages with an mmap'd arena (see
+// paging.cpp), and replays a sequence of operations on it, reporting
+// the throughput, the latency, the fragmentation and the memory used.
+//
+// the operations come from a synthetic workload, or from a trace
+// file, which has one operation per line:
+//
+//     a <id> <size>           alloc
+//     A <id> <size> <align>   alloc_aligned
+//     c <id> <size>           calloc
+//     r <id> <size>           realloc, or alloc if id is not live
+//     f <id>                  free
+//
+// ids name the live blocks, and are reused once a block is freed.
+// they can be written in any base strtoull understands, so addresses
+// recorded by the kernel work as they are. anything after a '#' is
+// ignored. a free of an id which is not live is skipped, so a trace
+// does not need to start with an empty heap.
+//
+// every block is filled with a pattern when it is allocated, as its
+// user would write it. with -c, the pattern is verified when the
+// block is freed, and the structures of the heap are checked every
+// few thousand operations and once everything is freed at the end.
+// the exit status is non zero if a check fails, which makes it the
+// regression gate of the allocator: make heapcheck.
+
+#include "check.h"
+
+#include <algorithm>
+#include <mem/heap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unordered_map>
+#include <vector>
+#include <x86intrin.h>
+
+struct Op {
+	char type;
+	u64  id;
+	siz  size;
+	siz  align;
+};
+
+struct Options {
+	siz         ops        = 200000;
+	u32         seed       = 1;
+	siz         heapSize   = 256 << 20;
+	bool        check      = false;
+	siz         checkEvery = 4096;
+	bool        magazines  = false;
+	const char *writeTo    = NULL;
+};
+
+static Options           options;
+static Heap              heap;
+static Heap::MagazineCache cache;
+static Paging::Directory directory;
+
+static u32 rnd() {
+	// xorshift, so that a workload is the same on every host
+	static u32 state;
+	if(!state)
+		state = options.seed ? options.seed : 1;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+static siz rndRange(siz lo, siz hi) {
+	return lo + rnd() % (hi - lo + 1);
+}
+
+// mostly small blocks, some medium ones, and a few large and page
+// aligned ones, roughly as the kernel allocates
+static siz rndSize() {
+	u32 r = rnd() % 100;
+	if(r < 60)
+		return rndRange(1, 256);
+	if(r < 80)
+		return rndRange(257, Heap::BlockEnd);
+	if(r < 94)
+		return rndRange(Heap::BlockEnd + 1, Heap::MediumEnd);
+	return rndRange(Heap::MediumEnd + 1, 512 << 10);
+}
+
+static Op makeAlloc(u64 id) {
+	u32 r = rnd() % 100;
+	siz n = rndSize();
+	if(r < 5)
+		return {'A', id, n, Paging::PageSize};
+	if(r < 8)
+		return {'A', id, n, (siz)1 << rndRange(3, 11)};
+	if(r < 15)
+		return {'c', id, n, 0};
+	return {'a', id, n, 0};
+}
+
+// allocs and frees in a random order, keeping the live bytes under
+// an eighth of the heap, as the large blocks only get a part of it,
+// with some reallocs in between
+static void randomWorkload(std::vector<Op> &ops) {
+	std::vector<std::pair<u64, siz>> live;
+	siz                              bytes = 0, cap = options.heapSize / 8;
+	u64                              next  = 1;
+	while(ops.size() < options.ops) {
+		u32 r = rnd() % 100;
+		if(!live.empty() && (r < 35 || bytes > cap)) {
+			siz k = rnd() % live.size();
+			ops.push_back({'f', live[k].first, 0, 0});
+			bytes -= live[k].second;
+			live[k] = live.back();
+			live.pop_back();
+		} else if(!live.empty() && r < 40) {
+			siz k = rnd() % live.size();
+			siz n = rndSize();
+			ops.push_back({'r', live[k].first, n, 0});
+			bytes += n - live[k].second;
+			live[k].second = n;
+		} else {
+			Op op = makeAlloc(next++);
+			ops.push_back(op);
+			live.push_back({op.id, op.size});
+			bytes += op.size;
+		}
+	}
+	for(auto &l : live) ops.push_back({'f', l.first, 0, 0});
+}
+
+// batches of blocks which are freed in the reverse order, as a
+// recursive task would
+static void lifoWorkload(std::vector<Op> &ops) {
+	u64 next = 1;
+	while(ops.size() < options.ops) {
+		siz count = rndRange(1, 256);
+		u64 first = next;
+		for(siz i = 0; i < count; i++) {
+			// the same size for the whole batch, most of the times
+			Op op = makeAlloc(next++);
+			if(i && rnd() % 4)
+				op.size = ops.back().size;
+			ops.push_back(op);
+		}
+		for(u64 id = next; id > first; id--) ops.push_back({'f', id - 1, 0, 0});
+	}
+}
+
+// a queue of blocks, which are freed in the order they are
+// allocated, as buffers passed between a producer and a consumer
+static void fifoWorkload(std::vector<Op> &ops) {
+	u64 next = 1, oldest = 1;
+	siz depth = 512;
+	while(ops.size() < options.ops) {
+		ops.push_back(makeAlloc(next++));
+		if(next - oldest > depth)
+			ops.push_back({'f', oldest++, 0, 0});
+	}
+	while(oldest < next) ops.push_back({'f', oldest++, 0, 0});
+}
+
+struct Workload {
+	const char *name;
+	void (*generate)(std::vector<Op> &ops);
+};
+
+static const Workload workloads[] = {{"random", randomWorkload},
+                                     {"lifo", lifoWorkload},
+                                     {"fifo", fifoWorkload}};
+
+static bool readTrace(const char *path, std::vector<Op> &ops) {
+	FILE *f = fopen(path, "r");
+	if(!f) {
+		perror(path);
+		return false;
+	}
+	char line[256];
+	siz  lineNo = 0;
+	while(fgets(line, sizeof(line), f)) {
+		lineNo++;
+		char *hash = strchr(line, '#');
+		if(hash)
+			*hash = 0;
+		char               type;
+		char               id[64];
+		unsigned long long size = 0, align = 0;
+		int                n    = sscanf(line, " %c %63s %llu %llu", &type, id,
+		                                 &size, &align);
+		if(n <= 0)
+			continue;
+		if(n < 2 || !strchr("aAcrf", type) ||
+		   (type != 'f' && n < 3) || (type == 'A' && n < 4)) {
+			fprintf(stderr, "%s:%zu: bad operation\n", path, lineNo);
+			fclose(f);
+			return false;
+		}
+		ops.push_back({type, strtoull(id, NULL, 0), (siz)size, (siz)align});
+	}
+	fclose(f);
+	return true;
+}
+
+static bool writeTrace(const char *path, const std::vector<Op> &ops) {
+	FILE *f = fopen(path, "w");
+	if(!f) {
+		perror(path);
+		return false;
+	}
+	for(const Op &op : ops) {
+		if(op.type == 'f')
+			fprintf(f, "f %llu\n", (unsigned long long)op.id);
+		else if(op.type == 'A')
+			fprintf(f, "A %llu %zu %zu\n", (unsigned long long)op.id,
+			        op.size, op.align);
+		else
+			fprintf(f, "%c %llu %zu\n", op.type,
+			        (unsigned long long)op.id, op.size);
+	}
+	fclose(f);
+	return true;
+}
+
+struct Block {
+	u8 *mem;
+	siz size;
+	u8  fill;
+};
+
+static bool verify(const Block &b, siz size) {
+	for(siz i = 0; i < size; i++) {
+		if(b.mem[i] != b.fill) {
+			printf("block %p of %zu bytes is corrupt at %zu\n", b.mem,
+			       b.size, i);
+			return false;
+		}
+	}
+	return true;
+}
+
+static void *doAlloc(siz size) {
+	return options.magazines ? heap.alloc(size, cache) : heap.alloc(size);
+}
+
+static void doFree(void *mem) {
+	if(options.magazines)
+		heap.free(mem, cache);
+	else
+		heap.free(mem);
+}
+
+// the number of tsc ticks in a nanosecond
+static double ticksPerNs() {
+	timespec a, b;
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	u64 start = __rdtsc();
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &b);
+	} while((b.tv_sec - a.tv_sec) * 1000000000 + (b.tv_nsec - a.tv_nsec) <
+	        20000000);
+	u64 ns = (b.tv_sec - a.tv_sec) * 1000000000 + (b.tv_nsec - a.tv_nsec);
+	return (double)(__rdtsc() - start) / ns;
+}
+
+static bool replay(const char *name, const std::vector<Op> &ops) {
+	Arena::init(options.heapSize);
+	Arena::Poison = options.check;
+	Paging::Directory::CurrentDirectory = &directory;
+	heap.init(Arena::Base, options.heapSize, &directory);
+	if(options.magazines)
+		cache.init();
+
+	std::unordered_map<u64, Block> live;
+	std::vector<u32>               latencies;
+	latencies.reserve(ops.size());
+	siz  skipped = 0, done = 0;
+	u64  total   = 0;
+	bool ok      = true;
+	for(siz i = 0; i < ops.size() && ok; i++) {
+		const Op &op = ops[i];
+		auto      it = live.find(op.id);
+		if(op.type == 'f' && it == live.end()) {
+			skipped++;
+			continue;
+		}
+		if(op.type != 'f' && op.type != 'r' && it != live.end()) {
+			// the free of the previous block is missing from the
+			// trace, so do it now, outside the clock
+			doFree(it->second.mem);
+			live.erase(it);
+			it = live.end();
+		}
+		if(options.check && it != live.end())
+			ok = verify(it->second, it->second.size);
+		void *mem      = NULL;
+		u64   syscalls = Arena::SyscallTicks;
+		u64   t        = __rdtsc();
+		switch(op.type) {
+			case 'a': mem = doAlloc(op.size); break;
+			case 'A': mem = heap.alloc_aligned(op.size, op.align); break;
+			case 'c': mem = heap.calloc(1, op.size); break;
+			case 'r':
+				mem = heap.realloc(it == live.end() ? NULL : it->second.mem,
+				                   op.size);
+				break;
+			case 'f': doFree(it->second.mem); break;
+		}
+		// the system calls of the mock paging stand for a few writes
+		// to the page tables in the kernel, so they are left out
+		t = __rdtsc() - t - (Arena::SyscallTicks - syscalls);
+		latencies.push_back(t);
+		total += t;
+		done++;
+		if(op.type == 'f' || (op.type == 'r' && op.size == 0)) {
+			if(it != live.end())
+				live.erase(it);
+		} else if(!mem) {
+			if(op.size) {
+				printf("%s: the heap ran out of memory at op %zu\n", name, i);
+				ok = false;
+			}
+		} else {
+			if(op.type == 'A' && ((uptr)mem & (op.align - 1))) {
+				printf("%s: block %p is not aligned to %zu\n", name, mem,
+				       op.align);
+				ok = false;
+			}
+			Block b = {(u8 *)mem, op.size, (u8)(op.id * 31 + i)};
+			if(options.check && op.type == 'c')
+				ok = ok && verify({b.mem, b.size, 0}, b.size);
+			if(options.check && op.type == 'r' && it != live.end())
+				ok = ok && verify({b.mem, b.size, it->second.fill},
+				                  std::min(b.size, it->second.size));
+			// the blocks are written as their users would, which
+			// maps their pages outside the clock
+			memset(b.mem, b.fill, b.size);
+			live[op.id] = b;
+		}
+		if(options.check && ok && (i + 1) % options.checkEvery == 0)
+			ok = checkHeap(heap, false);
+	}
+
+	// the state at the end of the trace, with whatever is still live
+	Heap::Stats st        = heap.stats();
+	siz         liveCount = live.size();
+	for(auto &l : live) {
+		if(options.check && ok)
+			ok = verify(l.second, l.second.size);
+		doFree(l.second.mem);
+	}
+	if(options.magazines)
+		heap.drain(cache);
+	if(options.check && ok)
+		ok = checkHeap(heap, true);
+
+	double tpn = ticksPerNs();
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [&](double p) {
+		return latencies.empty()
+		           ? 0.0
+		           : latencies[(siz)(p * (latencies.size() - 1))] / tpn;
+	};
+	rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	double seconds = total / tpn / 1e9;
+	printf("%s: %zu ops (%zu skipped), %.2f Mops/s\n", name, done, skipped,
+	       seconds > 0 ? done / seconds / 1e6 : 0.0);
+	printf("  latency ns: p50 %.0f p90 %.0f p99 %.0f p99.9 %.0f max %.0f\n",
+	       percentile(0.5), percentile(0.9), percentile(0.99),
+	       percentile(0.999), percentile(1));
+	printf("  peak in use: %zu KiB, peak mapped: %zu KiB (%.2fx), "
+	       "pages touched lazily: %llu in %llu faults\n",
+	       st.peakBytesInUse >> 10,
+	       (Paging::Frame::peak * Paging::PageSize) >> 10,
+	       st.peakBytesInUse
+	           ? (double)Paging::Frame::peak * Paging::PageSize /
+	                 st.peakBytesInUse
+	           : 0.0,
+	       (unsigned long long)Arena::Commits,
+	       (unsigned long long)Arena::Faults);
+	printf("  at the end: %zu blocks, %zu KiB in use, fragmentation: large "
+	       "%u/1000 huge %u/1000\n",
+	       liveCount, st.bytesInUse >> 10, st.largeFragmentation,
+	       st.hugeFragmentation);
+	printf("  peak rss of the harness: %ld KiB\n", ru.ru_maxrss);
+	if(!ok)
+		printf("%s: FAILED\n", name);
+	return ok;
+}
+
+static void usage() {
+	printf("usage: heaphost [options] <workload or trace file>...\n"
+	       "workloads: random lifo fifo all\n"
+	       "  -n <ops>    operations in a synthetic workload (%zu)\n"
+	       "  -s <seed>   seed of the synthetic workloads (%u)\n"
+	       "  -m <MiB>    size of the heap (%zu)\n"
+	       "  -c          check the blocks and the structures of the heap\n"
+	       "  -k          use a magazine cache, as kalloc and kfree do\n"
+	       "  -w <file>   write the operations of a workload to a trace\n"
+	       "  -a <pages>  pages mapped after a touched one (%u)\n",
+	       options.ops, options.seed, options.heapSize >> 20,
+	       Paging::FaultAround);
+}
+
+int main(int argc, char **argv) {
+	int  i  = 1;
+	bool ok = true;
+	for(; i < argc && argv[i][0] == '-'; i++) {
+		char opt = argv[i][1];
+		if(strchr("nsmwa", opt) && i + 1 >= argc) {
+			usage();
+			return 2;
+		}
+		switch(opt) {
+			case 'n': options.ops = strtoul(argv[++i], NULL, 0); break;
+			case 's': options.seed = strtoul(argv[++i], NULL, 0); break;
+			case 'm':
+				options.heapSize = strtoul(argv[++i], NULL, 0) << 20;
+				break;
+			case 'w': options.writeTo = argv[++i]; break;
+			case 'a': Paging::FaultAround = strtoul(argv[++i], NULL, 0); break;
+			case 'c': options.check = true; break;
+			case 'k': options.magazines = true; break;
+			default: usage(); return 2;
+		}
+	}
+	if(i == argc) {
+		usage();
+		return 2;
+	}
+	for(; i < argc; i++) {
+		bool all   = strcmp(argv[i], "all") == 0;
+		bool found = false;
+		for(const Workload &w : workloads) {
+			if(!all && strcmp(argv[i], w.name) != 0)
+				continue;
+			std::vector<Op> ops;
+			w.generate(ops);
+			if(options.writeTo && !writeTrace(options.writeTo, ops))
+				return 1;
+			ok    = replay(w.name, ops) && ok;
+			found = true;
+		}
+		if(found)
+			continue;
+		std::vector<Op> ops;
+		if(!readTrace(argv[i], ops))
+			return 1;
+		ok = replay(argv[i], ops) && ok;
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+// host replacement of the instructions the heap uses
+
+#include <sys/myos.h>
+
+struct Asm {
+	// value must not be 0 for both bsf and bsr
+	static inline u32 bsf(u32 value) {
+		return __builtin_ctz(value);
+	}
+
+	static inline u32 bsr(u32 value) {
+		return 31 - __builtin_clz(value);
+	}
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+// host replacement of the terminal, which writes to stdout
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/myos.h>
+
+struct Terminal {
+	enum class Mode { Dec, Hex, Bin, DecOnce, HexOnce, BinOnce, Reset };
+
+	static Mode currentMode;
+	static Mode previousMode;
+
+	static u32 write(const char *const &data) {
+		return printf("%s", data);
+	}
+	static u32 write(const char &c) {
+		return printf("%c", c);
+	}
+	static u32 write(Mode m) {
+		if(m == Mode::Reset) {
+			currentMode = previousMode;
+		} else {
+			previousMode = currentMode;
+			currentMode  = m;
+		}
+		return 0;
+	}
+	static u32 write(void *const &value) {
+		return printf("%p", value);
+	}
+	static u32 write(const bool &value) {
+		return printf(value ? "true" : "false");
+	}
+	template <typename T> static u32 write(const T &value) {
+		u32 res;
+		if(currentMode == Mode::Hex || currentMode == Mode::HexOnce)
+			res = printf("0x%llx", (unsigned long long)value);
+		else
+			res = printf("%lld", (long long)value);
+		if(currentMode == Mode::HexOnce || currentMode == Mode::DecOnce)
+			currentMode = previousMode;
+		return res;
+	}
+	template <typename F, typename... T>
+	static u32 write(const F &arg, const T &...args) {
+		u32 res = write(arg);
+		return res + write(args...);
+	}
+
+	template <typename... T> static void err(const T &...args) {
+		write("[ ERR ] ", args...);
+		fflush(stdout);
+		abort();
+	}
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+// host replacement of the paging of the kernel. the pages live in an
+// arena, which is mapped PROT_NONE, and a page is made accessible
+// when it is allocated. see tools/heaphost/paging.cpp.
+
+#include <sys/myos.h>
+
+struct Paging {
+	static const siz PageSize = 0x1000; // 4KiB
+
+	static constexpr bool isAligned(uptr addr) {
+		return (addr & (PageSize - 1)) == 0;
+	}
+
+	static constexpr void alignAddress(uptr &addr) {
+		addr &= ~(PageSize - 1);
+		addr += PageSize;
+	}
+
+	static constexpr void alignIfNeeded(uptr &addr) {
+		if(!isAligned(addr))
+			alignAddress(addr);
+	}
+
+	struct Frame {
+		static siz used; // pages which are accessible right now
+		static siz peak;
+	};
+
+	// same layout as the kernel's
+	struct Page {
+		u8 present : 1;
+		u8 rw : 1;
+		u8 user : 1;
+		u8 unused_1 : 2;
+		u8 accessed : 1;
+		u8 dirty : 1;
+		u8 unused_3 : 1;
+		union {
+			struct {
+				u16 unused_2 : 1;
+				u16 os_shared : 1;
+				u16 unused_4 : 2;
+				u32 frame : 20;
+			} __attribute__((packed)) inmem;
+			struct {
+				// marks a page which is reserved by a heap
+				u8  os_avail : 1;
+				u32 os_unused : 23;
+			} __attribute__((packed)) outmem;
+		} __attribute__((packed));
+
+		uptr alloc(bool isKernel, bool isWritable, uptr lastFrame = 0);
+		void free();
+	} __attribute__((packed));
+
+	struct Region {
+		enum Kind : u8 { None, Reserved, DemandZero, Backed };
+		uptr        start, end;
+		const void *backing;
+		siz         backingSize;
+		Kind        kind;
+	};
+
+	// the regions are kept in a single table, whatever the directory
+	struct Directory {
+		static const siz  MaxRegions = 16;
+		static Region     Regions[MaxRegions];
+		static Directory *CurrentDirectory;
+	};
+
+	static void switchPageDirectory(Directory *dir) {
+		Directory::CurrentDirectory = dir;
+	}
+
+	// the arena of the pages, which is set up by Arena::init
+	static Page *getPage(uptr address, bool createIfAbsent, Directory *dir);
+	static void  resetPage(uptr address, Directory *dir, bool soft = false);
+	static bool  commitPage(uptr address, Directory *dir);
+
+	static Region *addRegion(uptr start, uptr end, Region::Kind kind,
+	                         Directory *dir, const void *backing = NULL,
+	                         siz backingSize = 0);
+	static Region *findRegion(uptr address, Directory *dir);
+	static void    resizeRegion(Region *r, uptr end);
+	static void    removeRegion(Region *r);
+	static bool    faultIn(uptr address, Directory *dir);
+	static u32     FaultAround;
+};
+
+// the address space a heap is created in
+struct Arena {
+	static uptr          Base;
+	static siz           Size;
+	static Paging::Page *Pages;
+	static u64           Commits; // pages mapped on their first touch
+	static u64           Faults;  // touches which mapped them
+	// time spent in the system calls which stand for the page tables,
+	// in tsc ticks, so that it can be left out of the measurements
+	static u64 SyscallTicks;
+	// fills the pages with garbage when they are mapped, to catch
+	// memory which is assumed to be zero
+	static bool Poison;
+
+	// maps a new arena of 'size' bytes, dropping the previous one
+	static void init(siz size);
+	static bool contains(uptr address) {
+		return address >= Base && address - Base < Size;
+	}
+};
@@ -0,0 +1,29 @@
+#pragma once
+
+// the host harness is single threaded, so a lock only has to catch
+// the heap taking it twice
+
+#include <stdlib.h>
+#include <sys/myos.h>
+
+struct SpinLock {
+	volatile u8 lk;
+
+	SpinLock() {
+		lk = 0;
+	}
+
+	void lock() {
+		if(lk)
+			abort();
+		lk = 1;
+	}
+
+	void unlock() {
+		lk = 0;
+	}
+
+	bool isLocked() {
+		return lk != 0;
+	}
+};
@@ -0,0 +1,6 @@
+#pragma once
+
+// the kernel's string functions are the ones of the host libc
+
+#include <string.h>
+#include <sys/myos.h>
@@ -0,0 +1,198 @@
+#include <mem/paging.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <x86intrin.h>
+
+Paging::Directory *Paging::Directory::CurrentDirectory = NULL;
+Paging::Region     Paging::Directory::Regions[MaxRegions];
+siz                Paging::Frame::used                 = 0;
+siz                Paging::Frame::peak                 = 0;
+u32                Paging::FaultAround                 = 4;
+
+uptr          Arena::Base         = 0;
+siz           Arena::Size         = 0;
+Paging::Page *Arena::Pages        = NULL;
+u64           Arena::Commits      = 0;
+u64           Arena::Faults       = 0;
+u64           Arena::SyscallTicks = 0;
+bool          Arena::Poison       = false;
+
+// a page which is reserved by the heap, or in a region, is mapped
+// when it is first touched, as the page fault handler of the kernel
+// does
+static void handleFault(int sig, siginfo_t *info, void *) {
+	if(Arena::contains((uptr)info->si_addr) &&
+	   Paging::faultIn((uptr)info->si_addr, NULL)) {
+		Arena::Faults++;
+		return;
+	}
+	// not ours, so let it crash the default way
+	signal(sig, SIG_DFL);
+}
+
+void Arena::init(siz size) {
+	if(Base) {
+		munmap((void *)Base, Size);
+		free(Pages);
+	}
+	void *mem = mmap(NULL, size, PROT_NONE,
+	                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(mem == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	Base    = (uptr)mem;
+	Size    = size;
+	Pages   = (Paging::Page *)calloc(size / Paging::PageSize,
+	                                 sizeof(Paging::Page));
+	Commits = Faults = SyscallTicks = 0;
+	memset(Paging::Directory::Regions, 0, sizeof(Paging::Directory::Regions));
+	Paging::Frame::used = Paging::Frame::peak = 0;
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = handleFault;
+	sa.sa_flags     = SA_SIGINFO | SA_NODEFER;
+	sigaction(SIGSEGV, &sa, NULL);
+}
+
+Paging::Page *Paging::getPage(uptr address, bool createIfAbsent,
+                              Directory *dir) {
+	(void)createIfAbsent;
+	(void)dir;
+	if(!Arena::contains(address)) {
+		fprintf(stderr, "page %#lx is outside the arena\n",
+		        (unsigned long)address);
+		abort();
+	}
+	return &Arena::Pages[(address - Arena::Base) / PageSize];
+}
+
+uptr Paging::Page::alloc(bool isKernel, bool isWritable, uptr lastFrame) {
+	(void)isKernel;
+	(void)lastFrame;
+	if(present)
+		return inmem.frame;
+	siz   idx   = this - Arena::Pages;
+	void *page  = (void *)(Arena::Base + idx * PageSize);
+	u64   start = __rdtsc();
+	if(mprotect(page, PageSize, PROT_READ | PROT_WRITE)) {
+		perror("mprotect");
+		abort();
+	}
+	Arena::SyscallTicks += __rdtsc() - start;
+	// a recycled frame holds whatever was left in it
+	if(Arena::Poison)
+		memset(page, 0xA5, PageSize);
+	outmem.os_avail = 0;
+	present         = 1;
+	rw              = isWritable;
+	inmem.frame     = idx + 1;
+	if(++Frame::used > Frame::peak)
+		Frame::peak = Frame::used;
+	return inmem.frame;
+}
+
+void Paging::Page::free() {
+	outmem.os_avail = 0;
+	if(!inmem.frame)
+		return;
+	void *page  = (void *)(Arena::Base + (inmem.frame - 1) * PageSize);
+	u64   start = __rdtsc();
+	// give the memory back to the host
+	madvise(page, PageSize, MADV_DONTNEED);
+	mprotect(page, PageSize, PROT_NONE);
+	Arena::SyscallTicks += __rdtsc() - start;
+	inmem.frame = 0;
+	present     = 0;
+	Frame::used--;
+}
+
+void Paging::resetPage(uptr address, Directory *dir, bool soft) {
+	Page *p = getPage(address, false, dir);
+	if(!soft) {
+		p->free();
+	} else {
+		p->inmem.frame = 0;
+		p->present     = 0;
+	}
+}
+
+bool Paging::commitPage(uptr address, Directory *dir) {
+	Page *p = getPage(address, false, dir);
+	if(p->present || !p->outmem.os_avail)
+		return false;
+	p->alloc(true, true);
+	memset((void *)(address & ~(PageSize - 1)), 0, PageSize);
+	Arena::Commits++;
+	return true;
+}
+
+Paging::Region *Paging::addRegion(uptr start, uptr end, Region::Kind kind,
+                                  Directory *dir, const void *backing,
+                                  siz backingSize) {
+	(void)dir;
+	for(siz i = 0; i < Directory::MaxRegions; i++) {
+		Region &r = Directory::Regions[i];
+		if(r.kind == Region::None) {
+			r = {start, end, backing, backingSize, kind};
+			return &r;
+		}
+	}
+	return NULL;
+}
+
+Paging::Region *Paging::findRegion(uptr address, Directory *dir) {
+	(void)dir;
+	for(siz i = 0; i < Directory::MaxRegions; i++) {
+		Region &r = Directory::Regions[i];
+		if(r.kind != Region::None && address >= r.start && address < r.end)
+			return &r;
+	}
+	return NULL;
+}
+
+void Paging::resizeRegion(Region *r, uptr end) {
+	r->end = end;
+}
+
+void Paging::removeRegion(Region *r) {
+	r->kind = Region::None;
+}
+
+static bool faultInPage(uptr address, Paging::Directory *dir) {
+	if(!Arena::contains(address))
+		return false;
+	if(Paging::commitPage(address, dir))
+		return true;
+	Paging::Region *r = Paging::findRegion(address, dir);
+	if(!r || r->kind == Paging::Region::Reserved)
+		return false;
+	Paging::Page *p = Paging::getPage(address, false, dir);
+	if(p->present)
+		return false;
+	p->alloc(true, true);
+	siz offset = address - r->start, copied = 0;
+	if(r->kind == Paging::Region::Backed && offset < r->backingSize) {
+		copied = r->backingSize - offset;
+		if(copied > Paging::PageSize)
+			copied = Paging::PageSize;
+		memcpy((void *)address, (const u8 *)r->backing + offset, copied);
+	}
+	memset((void *)(address + copied), 0, Paging::PageSize - copied);
+	Arena::Commits++;
+	return true;
+}
+
+bool Paging::faultIn(uptr address, Directory *dir) {
+	address &= ~(PageSize - 1);
+	if(!faultInPage(address, dir))
+		return false;
+	for(u32 i = 1; i <= FaultAround; i++)
+		if(!faultInPage(address + i * PageSize, dir))
+			break;
+	return true;
+}
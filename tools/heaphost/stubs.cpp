@@ -0,0 +1,33 @@
+// the parts of the kernel which the heap links against, but which
+// can't run on the host
+
+#include <drivers/terminal.h>
+#include <mem/memory.h>
+#include <stdio.h>
+#include <sys/stacktrace.h>
+
+Terminal::Mode Terminal::currentMode  = Terminal::Mode::Dec;
+Terminal::Mode Terminal::previousMode = Terminal::Mode::Dec;
+
+const char *Memory::TagNames[(siz)MemTag::Count] = {"none", "scheduler",
+                                                    "paging", "terminal"};
+
+u32 Stacktrace::capture(uptr *eips, u32 max, u32 skip) {
+	StackFrame *stk   = (StackFrame *)__builtin_frame_address(0);
+	u32         count = 0;
+	// the outermost frames of the host don't end with a NULL, so
+	// stop once the frames stop growing upwards
+	for(; stk && count < max; stk = stk->next) {
+		if(skip > 0)
+			skip--;
+		else
+			eips[count++] = stk->eip;
+		if(stk->next <= stk)
+			break;
+	}
+	return count;
+}
+
+void Stacktrace::printSymbol(uptr eip) {
+	printf("%#lx", (unsigned long)eip);
+}
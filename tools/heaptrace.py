@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+# converts the heap operations streamed by a kernel built with
+# HEAP_TRACE=1 (see mem/heaptrace.h) into a trace for heaphost:
+#
+#   make iso HEAP_TRACE=1 QEMUFLAGS="-serial stdio -serial file:heaptrace.bin"
+#   (run the workload, then 'heaptracestream' in the shell)
+#   tools/heaptrace.py heaptrace.bin > trace.txt
+#   make heaphost && tools/heaphost/heaphost trace.txt
+#
+# the operations of all the heaps are merged into one trace by
+# default. -k keeps only the kernel heap, and -t <id> only the heap
+# of that task. if the capture holds more than one stream, the last
+# one is converted.
+
+import struct
+import sys
+
+MAGIC = b"HTRC"
+VERSION = 1
+HEADER = struct.Struct("<4sHHIIQ")
+RECORD = struct.Struct("<QIIIHBB")
+KERNEL_HEAP = 1
+
+
+def usage():
+    sys.stderr.write("usage: %s [-k | -t <task id>] <capture>\n" % sys.argv[0])
+    sys.exit(2)
+
+
+def parse_args(argv):
+    heap = None  # all of them
+    path = None
+    i = 0
+    while i < len(argv):
+        if argv[i] == "-k":
+            heap = "kernel"
+        elif argv[i] == "-t" and i + 1 < len(argv):
+            i += 1
+            heap = int(argv[i], 0)
+        elif argv[i].startswith("-") or path is not None:
+            usage()
+        else:
+            path = argv[i]
+        i += 1
+    if path is None:
+        usage()
+    return heap, path
+
+
+def read_stream(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    start = data.rfind(MAGIC)
+    if start < 0:
+        sys.exit("%s: no heap trace found" % path)
+    magic, version, size, count, dropped, ticks = HEADER.unpack_from(data, start)
+    if version != VERSION or size != RECORD.size:
+        sys.exit("%s: version %d of the trace is not supported" % (path, version))
+    start += HEADER.size
+    available = (len(data) - start) // RECORD.size
+    if available < count:
+        sys.stderr.write("%s: the stream is cut short, %d of %d records\n" %
+                         (path, available, count))
+        count = available
+    records = [RECORD.unpack_from(data, start + i * RECORD.size)
+               for i in range(count)]
+    return records, dropped, ticks
+
+
+def convert(records, heap, out):
+    # the blocks get ids of their own, as an address is shared by the
+    # task heaps, and by a block and the one which is allocated at the
+    # same place after it is freed
+    live = {}
+    next_id = 1
+    skipped = 0
+    for tsc, address, size, extra, task, op, flags in records:
+        key = "kernel" if flags & KERNEL_HEAP else task
+        if heap is not None and key != heap:
+            continue
+        op = chr(op)
+        if address == 0:
+            # a failed alloc, or a free of NULL
+            continue
+        if op == "f":
+            block = live.pop((key, address), None)
+            if block is None:
+                # allocated before the oldest record in the ring
+                skipped += 1
+            else:
+                out.write("f 0x%x\n" % block)
+            continue
+        if op == "r":
+            block = live.pop((key, extra), None)
+            if block is not None:
+                live[(key, address)] = block
+                out.write("r 0x%x %d\n" % (block, size))
+                continue
+            op = "a"
+        # the free of the block which was here may not have made it
+        # into the ring, or was recorded by a racing task after this
+        block = live.pop((key, address), None)
+        if block is not None:
+            out.write("f 0x%x\n" % block)
+        block = next_id
+        next_id += 1
+        live[(key, address)] = block
+        if op == "a" or (op == "c" and extra == 0):
+            out.write("%s 0x%x %d\n" % (op, block, size))
+        else:
+            # heaphost has no aligned calloc, its blocks are written
+            # as they are allocated anyway
+            out.write("A 0x%x %d %d\n" % (block, size, extra))
+    return skipped
+
+
+def main():
+    heap, path = parse_args(sys.argv[1:])
+    records, dropped, ticks = read_stream(path)
+    out = sys.stdout
+    out.write("# %d operations from %s, %d dropped before them\n" %
+              (len(records), path, dropped))
+    if records and ticks:
+        ms = (records[-1][0] - records[0][0]) / ticks
+        out.write("# recorded over %.1f ms\n" % ms)
+    skipped = convert(records, heap, out)
+    if skipped:
+        out.write("# %d frees of blocks allocated before the trace\n" % skipped)
+
+
+if __name__ == "__main__":
+    main()